@@ -8,20 +8,55 @@
 
 #define _USE_MATH_DEFINES
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 #include <vector>
+#include <string>
+#include <random>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <algorithm>
+#include <deque>
+#include <unordered_map>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <thread>
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>      // SSE2 for the software rasterizer
+#define SOFTWARE_SIMD 1
+#endif
 
 #if defined(__APPLE__)
 #include <GLUT/GLUT.h>
 #include <OpenGL/gl3.h>
 #include <OpenGL/glu.h>
+#include <OpenGL/OpenGL.h>  // CGLSetParameter for the swap interval
 #else
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
 #include <windows.h>
+#include <direct.h>         // _mkdir for the shader cache
 #endif
 #include <GL/glew.h>        // must be downloaded
 #include <GL/freeglut.h>    // must be downloaded unless you have an Apple
+#if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32__)
+#include <GL/glx.h>         // glXGetProcAddressARB for the swap interval
+#endif
+#endif
+
+#if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32__)
+#include <sys/resource.h>   // getrusage for the benchmark memory report
+#include <unistd.h>
+#endif
+#include <sys/stat.h>       // mkdir for the shader cache, modification times for hot reloading
+#if defined(__linux__)
+#include <sys/inotify.h>    // shader hot reloading
+#include <poll.h>
 #endif
 
 const unsigned int windowWidth = 512, windowHeight = 512;
@@ -105,15 +140,676 @@ struct vec2
 };
 
 
+// sections of a frame that are timed on the CPU
+enum ProfileSection {
+    SectionUpdate,
+    SectionCull,
+    SectionDraw,
+    SectionOverlay,
+    SectionSwap,
+    SectionFrame,
+    SectionCount
+};
+
+const char* profileSectionNames[SectionCount] = { "update", "cull", "draw", "overlay", "swap", "frame" };
+
+// selects the input latency instead of a section in Profiler::Percentile
+const int ProfileInputLatency = SectionCount + 1;
+
+// timings and counters collected for a single rendered frame
+struct FrameRecord
+{
+    double start[SectionCount];     // seconds since the profiler was created
+    double duration[SectionCount];  // seconds
+    double gpuTime;                 // seconds, negative until the timer query result arrived
+    int drawCalls;
+    int stateChanges;
+    int vertices;
+    double inputLatency;            // seconds from the oldest input handled by the frame to its swap, -1 without input
+    int inputEvents;                // input events coalesced into the frame
+};
+
+// Collects CPU section timers, GPU timer queries and draw statistics of the last frames into a
+// ring buffer, from which rolling percentiles are computed and trace files are exported.
+class Profiler
+{
+    static const int historySize = 600;
+    static const int queryCount = 2;
+    
+    std::chrono::steady_clock::time_point epoch;
+    std::vector<FrameRecord> history;
+    long long frameCount;
+    FrameRecord current;
+    
+    unsigned int queries[queryCount];
+    long long queryFrame[queryCount];   // frame whose GPU time the query measures, -1 if unused
+    bool gpuTimers;
+    bool gpuQueryActive;    // the current frame is being measured
+    
+    double pendingInput;    // arrival of the oldest input not yet taken by a frame, -1 if there is none
+    int pendingEvents;
+    double frameInput;      // arrival of the oldest input the current frame handles
+    
+    FrameRecord* GetRecord(long long frame) {
+        if (frame < 0 || frame >= frameCount || frameCount - frame > historySize) return NULL;
+        return &history[frame % historySize];
+    }
+    
+    // read back a finished timer query, optionally without waiting for the GPU
+    void CollectQuery(int i, bool wait) {
+        if (queryFrame[i] < 0) return;
+        int available = 0;
+        glGetQueryObjectiv(queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available && !wait) return;
+        GLuint64 elapsed = 0;
+        glGetQueryObjectui64v(queries[i], GL_QUERY_RESULT, &elapsed);
+        FrameRecord* record = GetRecord(queryFrame[i]);
+        if (record) record->gpuTime = elapsed * 1e-9;
+        queryFrame[i] = -1;
+    }
+    
+    void ResetCurrent() {
+        for (int i = 0; i < SectionCount; i++) {
+            current.start[i] = -1;
+            current.duration[i] = 0;
+        }
+        current.gpuTime = -1;
+        current.drawCalls = 0;
+        current.stateChanges = 0;
+        current.vertices = 0;
+        current.inputLatency = -1;
+        current.inputEvents = 0;
+        frameInput = -1;
+    }
+    
+public:
+    Profiler() : epoch(std::chrono::steady_clock::now()), history(historySize) {
+        frameCount = 0;
+        gpuTimers = false;
+        gpuQueryActive = false;
+        pendingInput = -1;
+        pendingEvents = 0;
+        for (int i = 0; i < queryCount; i++) {
+            queries[i] = 0;
+            queryFrame[i] = -1;
+        }
+        ResetCurrent();
+    }
+    
+    // create the timer queries, needs a current OpenGL context
+    void Initialize() {
+        glGenQueries(queryCount, queries);
+        gpuTimers = glGetError() == GL_NO_ERROR;
+    }
+    
+    double Now() {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - epoch).count();
+    }
+    
+    void Begin(ProfileSection section) {
+        if (current.start[section] < 0) current.start[section] = Now();
+        current.duration[section] -= Now();
+    }
+    
+    void End(ProfileSection section) {
+        current.duration[section] += Now();
+    }
+    
+    void CountDraw(int vertices) {
+        current.drawCalls++;
+        current.vertices += vertices;
+    }
+    
+    void CountStateChange() {
+        current.stateChanges++;
+    }
+    
+    // an input event arrived, its latency is measured by the next frame that takes it
+    void CountInput() {
+        if (pendingInput < 0) pendingInput = Now();
+        pendingEvents++;
+    }
+    
+    // The current frame handles all input that arrived so far. Its latency ends when the frame has
+    // been swapped, the closest the application gets to the moment the result reaches the screen.
+    void TakeInput() {
+        if (pendingInput < 0) return;
+        if (frameInput < 0) frameInput = pendingInput;
+        current.inputEvents += pendingEvents;
+        pendingInput = -1;
+        pendingEvents = 0;
+    }
+    
+    // Start measuring the GPU time of the frame, the result is read back a frame later. If the GPU
+    // is so far behind that the query of this slot has no result yet, the frame goes unmeasured
+    // rather than waiting for it.
+    void BeginGpuFrame() {
+        gpuQueryActive = false;
+        if (!gpuTimers) return;
+        int i = frameCount % queryCount;
+        CollectQuery(i, false);
+        if (queryFrame[i] >= 0) return;
+        glBeginQuery(GL_TIME_ELAPSED, queries[i]);
+        queryFrame[i] = frameCount;
+        gpuQueryActive = true;
+    }
+    
+    void EndGpuFrame() {
+        if (!gpuQueryActive) return;
+        glEndQuery(GL_TIME_ELAPSED);
+        gpuQueryActive = false;
+    }
+    
+    void EndFrame() {
+        if (frameInput >= 0) current.inputLatency = Now() - frameInput;
+        history[frameCount % historySize] = current;
+        frameCount++;
+        ResetCurrent();
+        for (int i = 0; i < queryCount; i++) CollectQuery(i, false);
+    }
+    
+    int GetFrameCount() {
+        return (int)fmin(frameCount, historySize);
+    }
+    
+    // the i-th oldest frame still in the history
+    FrameRecord& GetFrame(int i) {
+        return history[(frameCount - GetFrameCount() + i) % historySize];
+    }
+    
+    // percentile (0..100) of a section duration over the history, SectionCount selects the GPU time
+    // and ProfileInputLatency the latency of the frames that handled input
+    double Percentile(int section, double p) {
+        std::vector<double> values;
+        for (int i = 0; i < GetFrameCount(); i++) {
+            FrameRecord& record = GetFrame(i);
+            double value = section == SectionCount ? record.gpuTime :
+                           section == ProfileInputLatency ? record.inputLatency : record.duration[section];
+            if (value >= 0) values.push_back(value);
+        }
+        if (values.empty()) return 0;
+        size_t n = (size_t)fmin(values.size() - 1, floor(p / 100.0 * values.size()));
+        std::nth_element(values.begin(), values.begin() + n, values.end());
+        return values[n];
+    }
+    
+    void PrintSummary(char* buffer, int size) {
+        FrameRecord& last = GetFrame(GetFrameCount() - 1);
+        snprintf(buffer, size,
+                 "frame p50 %.2f p95 %.2f p99 %.2f ms | gpu p50 %.2f p95 %.2f ms | input p50 %.2f p95 %.2f ms"
+                 " | %d draws %d states %d verts",
+                 Percentile(SectionFrame, 50) * 1000, Percentile(SectionFrame, 95) * 1000,
+                 Percentile(SectionFrame, 99) * 1000, Percentile(SectionCount, 50) * 1000,
+                 Percentile(SectionCount, 95) * 1000, Percentile(ProfileInputLatency, 50) * 1000,
+                 Percentile(ProfileInputLatency, 95) * 1000, last.drawCalls, last.stateChanges, last.vertices);
+    }
+    
+    // one line per frame with all section durations in milliseconds
+    bool ExportCSV(const char* filename) {
+        FILE* file = fopen(filename, "w");
+        if (!file) { printf("Cannot write %s\n", filename); return false; }
+        fprintf(file, "frame");
+        for (int s = 0; s < SectionCount; s++) fprintf(file, ",%s_ms", profileSectionNames[s]);
+        fprintf(file, ",gpu_ms,draw_calls,state_changes,vertices,input_latency_ms,input_events\n");
+        for (int i = 0; i < GetFrameCount(); i++) {
+            FrameRecord& record = GetFrame(i);
+            fprintf(file, "%d", i);
+            for (int s = 0; s < SectionCount; s++) fprintf(file, ",%.4f", record.duration[s] * 1000);
+            fprintf(file, ",%.4f,%d,%d,%d,%.4f,%d\n", record.gpuTime * 1000, record.drawCalls, record.stateChanges,
+                    record.vertices, record.inputLatency * 1000, record.inputEvents);
+        }
+        fclose(file);
+        return true;
+    }
+    
+    // Chrome trace event format, open with chrome://tracing or Perfetto
+    bool ExportTrace(const char* filename) {
+        FILE* file = fopen(filename, "w");
+        if (!file) { printf("Cannot write %s\n", filename); return false; }
+        fprintf(file, "{\"traceEvents\":[\n");
+        bool first = true;
+        for (int i = 0; i < GetFrameCount(); i++) {
+            FrameRecord& record = GetFrame(i);
+            for (int s = 0; s < SectionCount; s++) {
+                if (record.start[s] < 0) continue;
+                fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.1f,\"dur\":%.1f}",
+                        first ? "" : ",\n", profileSectionNames[s], record.start[s] * 1e6, record.duration[s] * 1e6);
+                first = false;
+            }
+            if (record.gpuTime >= 0 && record.start[SectionFrame] >= 0) {
+                fprintf(file, "%s{\"name\":\"gpu\",\"ph\":\"X\",\"pid\":1,\"tid\":2,\"ts\":%.1f,\"dur\":%.1f}",
+                        first ? "" : ",\n", record.start[SectionFrame] * 1e6, record.gpuTime * 1e6);
+                fprintf(file, ",\n{\"name\":\"counters\",\"ph\":\"C\",\"pid\":1,\"ts\":%.1f,"
+                        "\"args\":{\"draw_calls\":%d,\"state_changes\":%d,\"vertices\":%d}}",
+                        record.start[SectionFrame] * 1e6, record.drawCalls, record.stateChanges, record.vertices);
+                first = false;
+            }
+            if (record.inputLatency >= 0 && record.start[SectionFrame] >= 0) {
+                // from the oldest input to the end of the frame that showed it
+                double end = record.start[SectionFrame] + record.duration[SectionFrame];
+                fprintf(file, "%s{\"name\":\"input\",\"ph\":\"X\",\"pid\":1,\"tid\":3,\"ts\":%.1f,\"dur\":%.1f,"
+                        "\"args\":{\"events\":%d}}", first ? "" : ",\n", (end - record.inputLatency) * 1e6,
+                        record.inputLatency * 1e6, record.inputEvents);
+                first = false;
+            }
+        }
+        fprintf(file, "\n]}\n");
+        fclose(file);
+        return true;
+    }
+};
+
+Profiler profiler;
+
+// Work-stealing thread pool. Every thread owns a queue of jobs; it takes its own work from the
+// back and, when that runs dry, steals from the front of the other queues. The calling thread
+// takes part in ParallelFor, so a pool of n threads starts n - 1 workers.
+class JobSystem
+{
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> jobs;
+    };
+    
+    std::vector<std::thread> workers;
+    std::vector<Queue*> queues;     // queue 0 belongs to the calling thread
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    std::atomic<int> pending;
+    bool stop;
+    
+    bool TryRun(int self) {
+        std::function<void()> job;
+        {
+            std::lock_guard<std::mutex> lock(queues[self]->mutex);
+            if (!queues[self]->jobs.empty()) {
+                job = std::move(queues[self]->jobs.back());
+                queues[self]->jobs.pop_back();
+            }
+        }
+        for (int k = 1; !job && k < queues.size(); k++) {
+            Queue* victim = queues[(self + k) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim->mutex);
+            if (!victim->jobs.empty()) {
+                job = std::move(victim->jobs.front());
+                victim->jobs.pop_front();
+            }
+        }
+        if (!job) return false;
+        pending--;
+        job();
+        return true;
+    }
+    
+    void WorkerLoop(int self) {
+        while (true) {
+            if (TryRun(self)) continue;
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            wake.wait(lock, [this]() { return stop || pending > 0; });
+            if (stop) return;
+        }
+    }
+    
+public:
+    JobSystem() : pending(0), stop(false) {
+        queues.push_back(new Queue());
+    }
+    
+    ~JobSystem() {
+        Stop();
+        delete queues[0];
+    }
+    
+    // number of threads including the caller, 0 uses all hardware threads
+    void Start(int threads) {
+        Stop();
+        if (threads <= 0) threads = (int)fmax(std::thread::hardware_concurrency(), 1);
+        stop = false;
+        for (int i = 1; i < threads; i++) queues.push_back(new Queue());
+        for (int i = 1; i < threads; i++) workers.push_back(std::thread(&JobSystem::WorkerLoop, this, i));
+    }
+    
+    void Stop() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stop = true;
+        }
+        wake.notify_all();
+        for (int i = 0; i < workers.size(); i++) workers[i].join();
+        workers.clear();
+        for (int i = 1; i < queues.size(); i++) delete queues[i];
+        queues.resize(1);
+    }
+    
+    int GetThreadCount() {
+        return (int)queues.size();
+    }
+    
+    // calls func(begin, end) for chunks of [0, count) on all threads and returns when all are done
+    template<typename Function>
+    void ParallelFor(int count, int chunkSize, Function func) {
+        int chunks = (count + chunkSize - 1) / chunkSize;
+        if (chunks <= 1 || workers.empty()) {
+            // same chunks as in parallel, callers may keep per chunk results
+            for (int begin = 0; begin < count; begin += chunkSize) func(begin, (int)fmin(begin + chunkSize, count));
+            return;
+        }
+        
+        std::atomic<int> remaining(chunks);
+        for (int c = 0; c < chunks; c++) {
+            int begin = c * chunkSize;
+            int end = (int)fmin(begin + chunkSize, count);
+            Queue* queue = queues[c % queues.size()];
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            queue->jobs.push_back([&func, &remaining, begin, end]() {
+                func(begin, end);
+                remaining--;
+            });
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            pending += chunks;
+        }
+        wake.notify_all();
+        
+        while (remaining > 0) {
+            if (!TryRun(0)) std::this_thread::yield();
+        }
+    }
+};
+
+JobSystem jobs;
+
+
+// true if the current context advertises the extension
+bool HasExtension(const char* name) {
+    int count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for (int i = 0; i < count; i++) {
+        const char* extension = (const char*)glGetStringi(GL_EXTENSIONS, i);
+        if (extension && !strcmp(extension, name)) return true;
+    }
+    return false;
+}
+
+// Persists linked program binaries on disk, keyed by a hash of the sources and the driver, so
+// later launches skip GLSL compilation entirely. Drivers that offer no binary formats (or a
+// changed driver, which changes the key) simply fall back to compiling.
+class ShaderCache
+{
+    std::string directory;
+    std::string driver;
+    bool enabled;
+    
+    static unsigned long long Hash(const char* text, unsigned long long hash = 14695981039346656037ULL) {
+        for (; *text; text++) hash = (hash ^ (unsigned char)*text) * 1099511628211ULL;    // FNV-1a
+        return hash;
+    }
+    
+    std::string GetPath(unsigned long long key) {
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llx.bin", key);
+        return directory + name;
+    }
+    
+public:
+    int loaded, compiled;
+    
+    ShaderCache() {
+        enabled = false;
+        loaded = compiled = 0;
+    }
+    
+    // needs a current OpenGL context
+    void Initialize() {
+        int formats = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+        enabled = formats > 0;
+        driver = std::string((const char*)glGetString(GL_VENDOR)) + "|" + (const char*)glGetString(GL_RENDERER) +
+            "|" + (const char*)glGetString(GL_VERSION);
+        
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+        const char* base = getenv("LOCALAPPDATA");
+        directory = std::string(base ? base : ".") + "\\EventPlanner";
+        _mkdir(directory.c_str());
+#else
+        const char* base = getenv("XDG_CACHE_HOME");
+        const char* home = getenv("HOME");
+        directory = base ? base : home ? std::string(home) + "/.cache" : ".";
+        mkdir(directory.c_str(), 0755);
+        directory += "/eventplanner";
+        mkdir(directory.c_str(), 0755);
+#endif
+    }
+    
+    unsigned long long Key(const char* vertexSource, const char* fragmentSource) {
+        return Hash(driver.c_str(), Hash(fragmentSource, Hash(vertexSource)));
+    }
+    
+    // links program from a cached binary, false if there is none or the driver rejects it
+    bool Load(unsigned long long key, unsigned int program) {
+        if (!enabled) return false;
+        FILE* file = fopen(GetPath(key).c_str(), "rb");
+        if (!file) return false;
+        unsigned int header[2];     // binary format, length
+        std::vector<char> binary;
+        bool read = fread(header, sizeof(header), 1, file) == 1 && header[1] > 0;
+        if (read) {
+            binary.resize(header[1]);
+            read = fread(&binary[0], 1, binary.size(), file) == binary.size();
+        }
+        fclose(file);
+        if (!read) return false;
+        
+        glProgramBinary(program, header[0], &binary[0], (int)binary.size());
+        int OK = 0;
+        glGetProgramiv(program, GL_LINK_STATUS, &OK);
+        if (OK) loaded++;
+        return OK != 0;
+    }
+    
+    // writes the binary of a successfully linked program, via a rename so readers never see half a file
+    void Save(unsigned long long key, unsigned int program) {
+        compiled++;
+        if (!enabled) return;
+        int length = 0;
+        glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0) return;
+        std::vector<char> binary(length);
+        GLenum format = 0;
+        glGetProgramBinary(program, length, &length, &format, &binary[0]);
+        
+        std::string path = GetPath(key);
+        std::string temporary = path + ".tmp";
+        FILE* file = fopen(temporary.c_str(), "wb");
+        if (!file) return;
+        unsigned int header[2] = { format, (unsigned int)length };
+        bool written = fwrite(header, sizeof(header), 1, file) == 1 && fwrite(&binary[0], 1, length, file) == (size_t)length;
+        fclose(file);
+        if (!written || rename(temporary.c_str(), path.c_str()) != 0) remove(temporary.c_str());
+    }
+};
+
+ShaderCache shaderCache;
+
+// let the driver compile and link programs on its own threads; the status of a program is only
+// queried when it is needed, so all programs issued before that compile concurrently
+bool parallelShaderCompile = false;
+
+void EnableParallelShaderCompile() {
+#if defined(GL_KHR_parallel_shader_compile)
+    if (HasExtension("GL_KHR_parallel_shader_compile")) {
+        glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+        parallelShaderCompile = true;
+    }
+#endif
+}
+
+// directory with editable shader sources, empty when hot reloading is off
+std::string shaderDirectory;
+
+bool ReadTextFile(const std::string& path, std::string& text) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) return false;
+    text.clear();
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) text.append(buffer, n);
+    fclose(file);
+    return true;
+}
+
+// Reads name.extension from the shader directory into text. A missing file is created from the
+// built-in source, so the directory fills up with everything that can be edited.
+bool LoadShaderFile(const char* name, const char* extension, const char* builtIn, std::string& text) {
+    if (shaderDirectory.empty() || !name) return false;
+    std::string path = shaderDirectory + "/" + name + "." + extension;
+    if (ReadTextFile(path, text)) return true;
+    FILE* file = fopen(path.c_str(), "wb");
+    if (file) {
+        fputs(builtIn, file);
+        fclose(file);
+    }
+    return false;
+}
+
+class Shader;
+std::vector<Shader*> shaderRegistry;    // all shaders by name, for hot reloading
+
+// shapes fade out over the last pixel of their outline instead of relying on multisampling
+bool analyticCoverage = false;
+
+// there is no OpenGL context: no shaders or buffers are created and only the software rasterizer draws,
+// the GL calls are skipped at run time but still linked
+bool softwareOnly = false;
+
+// the narrow cyan stripes scroll, off by default so a static plan stays static and lets the scheduler sleep
+bool scrollStripes = false;
+
+// A periodic material parameter that the shaders evaluate from the frame time, so animating
+// any number of objects needs no CPU work per object: bias + amplitude * shape(time / period + phase)
+struct AnimationCurve
+{
+    enum Shape { Constant, Sine, Sawtooth, Pulse };
+    
+    int shape;
+    float period, amplitude, phase, bias;
+    
+    AnimationCurve(int shape = Constant, float period = 1, float amplitude = 0, float phase = 0, float bias = 0) :
+    shape(shape), period(period), amplitude(amplitude), phase(phase), bias(bias) {}
+    
+    bool IsAnimated() {
+        return shape != Constant && amplitude != 0;
+    }
+    
+    // Evaluate of the shaders on the CPU, for the software rasterizer
+    float Evaluate(float time) {
+        float x = time / period + phase;
+        float y = shape == Sine ? sinf(2 * (float)M_PI * x) : shape == Sawtooth ? x - floorf(x) :
+                  shape == Pulse ? powf(1 - (x - floorf(x)), 4) : 0;
+        return bias + amplitude * y;
+    }
+};
+
+// Uniform buffer behind the Frame block of the shaders, written once per frame and shared by all
+// programs.
+const unsigned int frameUniformBinding = 0;
+
+class FrameUniforms
+{
+    struct Block    // std140 layout
+    {
+        float time;
+        float padding[3];
+    };
+    
+    unsigned int buffer;
+    
+public:
+    FrameUniforms() {
+        buffer = 0;
+    }
+    
+    void Initialize() {
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(Block), NULL, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_UNIFORM_BUFFER, frameUniformBinding, buffer);
+    }
+    
+    void Update(float time) {
+        Block block = { time, { 0, 0, 0 } };
+        glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(Block), &block);
+    }
+};
+
+FrameUniforms frameUniforms;
+
+// per-object data streamed to the instanced programs every frame
+struct InstanceData
+{
+    float transform[4];     // model-view rows (m00, m01, m10, m11)
+    float translation[4];   // model-view translation and depth, w is 1
+    float color[4];
+};
+
+// attribute arrays 1..3 of the instanced programs read InstanceData with divisor 1
+const int instanceAttributeCount = 3;
+
 class Shader
 {
+    struct UniformLocation
+    {
+        unsigned int program;
+        const char* name;
+        int location;
+    };
+    std::vector<UniformLocation> locations;
+    
+    // a program that was compiled from source and whose status has not been checked yet
+    struct PendingProgram
+    {
+        unsigned int program;
+        unsigned int vertexShader;
+        unsigned int fragmentShader;
+        unsigned long long key;
+    };
+    std::vector<PendingProgram> pending;
+    
+    bool IsPending(unsigned int program)
+    {
+        for (int i = 0; i < pending.size(); i++) {
+            if (pending[i].program == program) return true;
+        }
+        return false;
+    }
+    
 protected:
     
+    const char* name;               // base name of the files in the shader directory
     unsigned int shaderProgram;
+    unsigned int instancedProgram;  // same sources compiled with INSTANCED defined
+    unsigned int currentProgram;    // the one selected by the last Run or RunInstanced
+    unsigned int reloadProgram;     // replacements that are still compiling
+    unsigned int reloadInstanced;
     
     void getErrorInfo(unsigned int handle)
     {
         int logLen;
+        if (glIsProgram(handle)) {
+            glGetProgramiv(handle, GL_INFO_LOG_LENGTH, &logLen);
+            if (logLen > 0)
+            {
+                char * log = new char[logLen];
+                int written;
+                glGetProgramInfoLog(handle, logLen, &written, log);
+                printf("Program log:\n%s", log);
+                delete[] log;
+            }
+            return;
+        }
         glGetShaderiv(handle, GL_INFO_LOG_LENGTH, &logLen);
         if (logLen > 0)
         {
@@ -121,7 +817,7 @@ protected:
             int written;
             glGetShaderInfoLog(handle, logLen, &written, log);
             printf("Shader log:\n%s", log);
-            delete log;
+            delete[] log;
         }
     }
     
@@ -149,20 +845,96 @@ protected:
         }
     }
     
+    // location of a uniform in the current program, looked up once instead of every frame
+    int GetUniformLocation(const char* name)
+    {
+        for (int i = 0; i < locations.size(); i++) {
+            if (locations[i].program == currentProgram && !strcmp(locations[i].name, name))
+                return locations[i].location;
+        }
+        UniformLocation entry = { currentProgram, name, glGetUniformLocation(currentProgram, name) };
+        locations.push_back(entry);
+        return entry.location;
+    }
+    
+    // per-object uniforms are instance attributes in the instanced programs
+    bool IsInstanced()
+    {
+        return currentProgram == instancedProgram;
+    }
+    
+    // copy of the source with a preprocessor definition inserted after the #version line
+    static std::string AddDefine(const char* source, const char* define)
+    {
+        std::string result = source;
+        size_t version = result.find("#version");
+        size_t line = version == std::string::npos ? 0 : result.find('\n', version) + 1;
+        return result.insert(line, std::string("#define ") + define + "\n");
+    }
+    
+    // compiles and links the program, and its instanced variant if asked for, from the sources
+    void BuildFromSource(const char *vertexSource, const char *fragmentSource, bool withInstanced)
+    {
+        CompileShader(vertexSource, fragmentSource);
+        
+        // connect Attrib Array to input variables of the vertex shader
+        glBindAttribLocation(shaderProgram, 0, "vertexPosition"); // vertexPosition gets values from Attrib Array 0
+        glBindAttribLocation(shaderProgram, 1, "vertexColor");    // only used by programs with per-vertex colors
+        
+        // connect the fragmentColor to the frame buffer memory
+        glBindFragDataLocation(shaderProgram, 0, "fragmentColor"); // fragmentColor goes to the frame buffer memory
+        
+        LinkShader();
+        
+        if (withInstanced) CompileInstanced(vertexSource, fragmentSource);
+    }
+    
+    // like BuildFromSource, but name.vert and name.frag in the shader directory take precedence
+    void Build(const char *vertexSource, const char *fragmentSource, bool withInstanced)
+    {
+        std::string vertexFile, fragmentFile;
+        if (LoadShaderFile(name, "vert", vertexSource, vertexFile)) vertexSource = vertexFile.c_str();
+        if (LoadShaderFile(name, "frag", fragmentSource, fragmentFile)) fragmentSource = fragmentFile.c_str();
+        BuildFromSource(vertexSource, fragmentSource, withInstanced);
+    }
+    
 public:
-    Shader() {
+    Shader(const char* name = 0) : name(name) {
         shaderProgram = 0;
+        instancedProgram = 0;
+        currentProgram = 0;
+        reloadProgram = 0;
+        reloadInstanced = 0;
+        shaderRegistry.push_back(this);
+    }
+    
+    const char* GetName() {
+        return name;
     }
     
     void CompileShader(const char *vertexSource, const char *fragmentSource)
     {
+        shaderProgram = CreateProgram(vertexSource, fragmentSource);
+        currentProgram = shaderProgram;
+    }
+    
+    // Creates a program that is either already linked from the binary cache or compiled from the
+    // sources. Compilation is only issued here; errors are reported by Finish, so the driver can
+    // work on all programs at the same time.
+    unsigned int CreateProgram(const char *vertexSource, const char *fragmentSource)
+    {
+        unsigned int program = glCreateProgram();
+        if (!program) { printf("Error in shader program creation\n"); exit(1); }
+        
+        unsigned long long key = shaderCache.Key(vertexSource, fragmentSource);
+        if (shaderCache.Load(key, program)) return program;
+        
         // create vertex shader from string
         unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
         if (!vertexShader) { printf("Error in vertex shader creation\n"); exit(1); }
         
         glShaderSource(vertexShader, 1, &vertexSource, NULL);
         glCompileShader(vertexShader);
-        checkShader(vertexShader, "Vertex shader error");
         
         // create fragment shader from string
         unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
@@ -170,49 +942,187 @@ public:
         
         glShaderSource(fragmentShader, 1, &fragmentSource, NULL);
         glCompileShader(fragmentShader);
-        checkShader(fragmentShader, "Fragment shader error");
         
         // attach shaders to a single program
-        shaderProgram = glCreateProgram();
-        if (!shaderProgram) { printf("Error in shader program creation\n"); exit(1); }
-        
-        glAttachShader(shaderProgram, vertexShader);
-        glAttachShader(shaderProgram, fragmentShader);
+        glAttachShader(program, vertexShader);
+        glAttachShader(program, fragmentShader);
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
         
+        PendingProgram entry = { program, vertexShader, fragmentShader, key };
+        pending.push_back(entry);
+        return program;
     }
     
     void LinkShader()
     {
-        // program packaging
-        glLinkProgram(shaderProgram);
-        checkLinking(shaderProgram);
+        // program packaging, programs from the binary cache are already linked
+        if (IsPending(shaderProgram)) glLinkProgram(shaderProgram);
+    }
+    
+    // variant that reads transformation and color from the instance attributes
+    void CompileInstanced(const char *vertexSource, const char *fragmentSource)
+    {
+        std::string instancedVertexSource = AddDefine(vertexSource, "INSTANCED");
+        std::string instancedFragmentSource = AddDefine(fragmentSource, "INSTANCED");
+        instancedProgram = CreateProgram(instancedVertexSource.c_str(), instancedFragmentSource.c_str());
+        
+        glBindAttribLocation(instancedProgram, 0, "vertexPosition");
+        glBindAttribLocation(instancedProgram, 1, "instanceTransform");
+        glBindAttribLocation(instancedProgram, 2, "instanceTranslation");
+        glBindAttribLocation(instancedProgram, 3, "instanceColor");
+        glBindFragDataLocation(instancedProgram, 0, "fragmentColor");
         
+        if (IsPending(instancedProgram)) glLinkProgram(instancedProgram);
     }
     
-    //deconstructor
-    ~Shader() {
-        glDeleteProgram(shaderProgram);
+    // true when the driver has finished compiling and linking, Finish will then not block
+    bool IsReady()
+    {
+#if defined(GL_COMPLETION_STATUS_KHR)
+        if (!parallelShaderCompile) return true;
+        for (int i = 0; i < pending.size(); i++) {
+            int done = 0;
+            glGetProgramiv(pending[i].program, GL_COMPLETION_STATUS_KHR, &done);
+            if (!done) return false;
+        }
+#endif
+        return true;
     }
     
-    void Run()
+    // reports compile and link errors of the programs built from source and stores their binaries,
+    // returns false if any of them failed
+    bool Finish()
     {
-        // make this program run
-        glUseProgram(shaderProgram);
+        bool linked = true;
+        for (int i = 0; i < pending.size(); i++) {
+            checkShader(pending[i].vertexShader, "Vertex shader error");
+            checkShader(pending[i].fragmentShader, "Fragment shader error");
+            int OK = 0;
+            glGetProgramiv(pending[i].program, GL_LINK_STATUS, &OK);
+            if (OK) shaderCache.Save(pending[i].key, pending[i].program);
+            else checkLinking(pending[i].program);
+            linked = linked && OK;
+            
+            // the program keeps the compiled code, the shader objects go away with it
+            glDetachShader(pending[i].program, pending[i].vertexShader);
+            glDetachShader(pending[i].program, pending[i].fragmentShader);
+            glDeleteShader(pending[i].vertexShader);
+            glDeleteShader(pending[i].fragmentShader);
+        }
+        pending.clear();
+        
+        // also the programs that came from the cache and were never pending
+        BindFrameBlock(shaderProgram);
+        BindFrameBlock(instancedProgram);
+        BindFrameBlock(reloadProgram);
+        BindFrameBlock(reloadInstanced);
+        return linked;
     }
     
-    virtual void UploadColor(vec4 color) {}
-    virtual void UploadStripeColor(vec4 color) {}
-    virtual void UploadStripeSize(int size) {}
-    virtual void UploadM(mat4 M) {}
-    virtual void UploadSelected(bool b) {}
+    bool IsReloading()
+    {
+        return reloadProgram != 0;
+    }
     
-};
-
-class StandardShader : public Shader
-{
+    // starts compiling new sources next to the active programs, which stay in use until FinishReload
+    void Reload(const std::string& vertexSource, const std::string& fragmentSource)
+    {
+        unsigned int activeProgram = shaderProgram, activeInstanced = instancedProgram;
+        BuildFromSource(vertexSource.c_str(), fragmentSource.c_str(), activeInstanced != 0);
+        reloadProgram = shaderProgram;
+        reloadInstanced = activeInstanced ? instancedProgram : 0;
+        shaderProgram = activeProgram;
+        instancedProgram = activeInstanced;
+        currentProgram = activeProgram;
+    }
+    
+    // swaps in the reloaded programs if they linked, otherwise drops them and keeps the old ones
+    bool FinishReload()
+    {
+        bool linked = Finish();
+        if (linked) {
+            glDeleteProgram(shaderProgram);
+            if (instancedProgram) glDeleteProgram(instancedProgram);
+            shaderProgram = reloadProgram;
+            instancedProgram = reloadInstanced;
+        }
+        else {
+            glDeleteProgram(reloadProgram);
+            if (reloadInstanced) glDeleteProgram(reloadInstanced);
+        }
+        reloadProgram = reloadInstanced = 0;
+        currentProgram = shaderProgram;
+        locations.clear();  // program names may be reused by the driver
+        return linked;
+    }
+    
+    //deconstructor
+    ~Shader() {
+        glDeleteProgram(shaderProgram);
+        if (instancedProgram) glDeleteProgram(instancedProgram);
+        shaderRegistry.erase(std::find(shaderRegistry.begin(), shaderRegistry.end(), this));
+    }
+    
+    // connects the Frame uniform block of a linked program to the frame uniform buffer
+    static void BindFrameBlock(unsigned int program)
+    {
+        int linked = 0;
+        if (program) glGetProgramiv(program, GL_LINK_STATUS, &linked);
+        if (!linked) return;
+        unsigned int index = glGetUniformBlockIndex(program, "Frame");
+        if (index != GL_INVALID_INDEX) glUniformBlockBinding(program, index, frameUniformBinding);
+    }
+    
+    // a curve is a vec4 of period, amplitude, phase and bias plus an int for the shape
+    void UploadCurve(const char* name, const char* shapeName, AnimationCurve curve)
+    {
+        int location = GetUniformLocation(name);
+        int shapeLocation = GetUniformLocation(shapeName);
+        if (location >= 0 && shapeLocation >= 0) {
+            glUniform4f(location, curve.period, curve.amplitude, curve.phase, curve.bias);
+            glUniform1i(shapeLocation, curve.shape);
+        }
+        else printf("uniform curve %s cannot be set\n", name);
+    }
+    
+    // programs without the uniform ignore the mode
+    void UploadCoverageMode() {
+        int location = GetUniformLocation("analyticCoverage");
+        if (location >= 0) glUniform1i(location, analyticCoverage);
+    }
+    
+    void Run()
+    {
+        // make this program run
+        glUseProgram(shaderProgram);
+        currentProgram = shaderProgram;
+        profiler.CountStateChange();
+        UploadCoverageMode();
+    }
+    
+    // view scales and offsets the instance positions, the default suits model-view instance data
+    void RunInstanced(vec4 view = vec4(1, 1, 0, 0))
+    {
+        glUseProgram(instancedProgram);
+        currentProgram = instancedProgram;
+        profiler.CountStateChange();
+        UploadCoverageMode();
+        int location = GetUniformLocation("view");
+        if (location >= 0) glUniform4fv(location, 1, view.v);
+    }
+    
+    virtual void UploadColor(vec4 color) {}
+    virtual void UploadStripeColor(vec4 color) {}
+    virtual void UploadStripeSize(int size) {}
+    virtual void UploadM(mat4 M) {}
+    
+};
+
+class StandardShader : public Shader
+{
     
 public:
-    StandardShader()
+    StandardShader() : Shader("standard")
     {
         // vertex shader in GLSL
         const char *vertexSource = R"(
@@ -220,22 +1130,33 @@ public:
         precision highp float;
         
         in vec2 vertexPosition;        // variable input from Attrib Array selected by glBindAttribLocation
+#ifdef INSTANCED
+        in vec4 instanceTransform;     // model-view rows (m00, m01, m10, m11)
+        in vec4 instanceTranslation;   // model-view translation, depth
+        in vec3 instanceColor;
+        uniform vec4 view;             // scale and offset applied after the instance transformation
+#else
         uniform vec3 vertexColor;
         uniform mat4 M;
-        uniform bool selected;
+#endif
         out vec3 color;            // output attribute
+        out float edge;            // 0 at the center of the triangle fan, 1 on its outline
         out vec2 modelSpacePos;
         
         void main()
         {
-            if (selected) {
-                color = vec3(1,1,1);
-            }
-            else {
-                color = vertexColor;
-            }
+#ifdef INSTANCED
+            vec3 vertexColor = instanceColor;
+#endif
+            color = vertexColor;
             modelSpacePos = vertexPosition;
+#ifdef INSTANCED
+            gl_Position = vec4((vertexPosition.x * instanceTransform.xy + vertexPosition.y * instanceTransform.zw +
+                                instanceTranslation.xy) * view.xy + view.zw, instanceTranslation.z, 1);
+#else
             gl_Position = vec4(vertexPosition.x, vertexPosition.y, 0, 1) * M;      // copy position from input to output
+#endif
+            edge = gl_VertexID == 0 ? 0.0 : 1.0;
         }
         )";
         
@@ -246,42 +1167,37 @@ public:
         
         in vec3 color;            // variable input: interpolated from the vertex colors
         in vec2 modelSpacePos;
+        in float edge;
+        uniform bool analyticCoverage;
+        
+        // Part of the pixel covered by the shape. edge is linear in every fan triangle, so its
+        // distance to 1 over its screen space gradient is the distance to the outline in pixels.
+        float Coverage()
+        {
+            if (!analyticCoverage) return 1.0;
+            return clamp((1.0 - edge) / max(length(vec2(dFdx(edge), dFdy(edge))), 1e-6) + 0.5, 0.0, 1.0);
+        }
         out vec4 fragmentColor;        // output that goes to the raster memory as told by glBindFragDataLocation
         
         void main()
         {
-            fragmentColor = vec4(color, 1); // extend RGB to RGBA
+            fragmentColor = vec4(color, Coverage()); // extend RGB to RGBA
         }
         )";
         
-        CompileShader(vertexSource, fragmentSource);
-        
-        // connect Attrib Array to input variables of the vertex shader
-        glBindAttribLocation(shaderProgram, 0, "vertexPosition"); // vertexPosition gets values from Attrib Array 0
-        
-        // connect the fragmentColor to the frame buffer memory
-        glBindFragDataLocation(shaderProgram, 0, "fragmentColor"); // fragmentColor goes to the frame buffer memory
-        
-        LinkShader();
-        
+        Build(vertexSource, fragmentSource, true);
     }
     
     void UploadColor(vec4 color) {
-        int location = glGetUniformLocation(shaderProgram, "vertexColor");
+        int location = GetUniformLocation("vertexColor");
         if (location >= 0) glUniform3fv(location, 1, &color.v[0]); // set uniform variable vertexColor
-        else printf("uniform vertex color cannot be set\n");
+        else if (!IsInstanced()) printf("uniform vertex color cannot be set\n");
     }
     
     void UploadM(mat4 M) {
-        int location = glGetUniformLocation(shaderProgram, "M");
+        int location = GetUniformLocation("M");
         if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, M);
-        else printf("uniform M cannot be set\n");
-    }
-    
-    void UploadSelected(bool selected) {
-        int location = glGetUniformLocation(shaderProgram, "selected");
-        if (location >= 0) glUniform1i(location, selected);
-        else printf("uniform selected boolean cannot be set\n");
+        else if (!IsInstanced()) printf("uniform M cannot be set\n");
     }
     
 };
@@ -290,7 +1206,7 @@ class StripesShader : public Shader
 {
     
 public:
-    StripesShader()
+    StripesShader() : Shader("stripes")
     {
         // vertex shader in GLSL
         const char *vertexSource = R"(
@@ -298,28 +1214,39 @@ public:
         precision highp float;
         
         in vec2 vertexPosition;        // variable input from Attrib Array selected by glBindAttribLocation
+#ifdef INSTANCED
+        in vec4 instanceTransform;     // model-view rows (m00, m01, m10, m11)
+        in vec4 instanceTranslation;   // model-view translation, depth
+        in vec3 instanceColor;
+        uniform vec4 view;             // scale and offset applied after the instance transformation
+#else
         uniform vec3 vertexColor;
+        uniform mat4 M;
+#endif
         uniform vec3 stripeColor;
         uniform float stripeSize;
-        uniform mat4 M;
-        uniform bool selected;
         out vec3 color;            // output attribute
+        out float edge;            // 0 at the center of the triangle fan, 1 on its outline
         out vec3 scolor;
         out float size;
         out vec2 modelSpacePos;
         
         void main()
         {
-            if (selected) {
-                color = vec3(1,1,1);
-            }
-            else {
-                color = vertexColor;
-            }
+#ifdef INSTANCED
+            vec3 vertexColor = instanceColor;
+#endif
+            color = vertexColor;
             scolor = stripeColor;
             size = stripeSize;
             modelSpacePos = vertexPosition;
+#ifdef INSTANCED
+            gl_Position = vec4((vertexPosition.x * instanceTransform.xy + vertexPosition.y * instanceTransform.zw +
+                                instanceTranslation.xy) * view.xy + view.zw, instanceTranslation.z, 1);
+#else
             gl_Position = vec4(vertexPosition.x, vertexPosition.y, 0, 1) * M;      // copy position from input to output
+#endif
+            edge = gl_VertexID == 0 ? 0.0 : 1.0;
         }
         )";
         
@@ -333,61 +1260,74 @@ public:
         in float size;
         
         in vec2 modelSpacePos;
+        in float edge;
+        uniform bool analyticCoverage;
+        uniform vec4 scroll;           // stripe offset curve
+        uniform int scrollShape;
+        layout(std140) uniform Frame
+        {
+            float time;                // seconds, the same for all programs
+        };
+        
+        // bias + amplitude * shape(time / period + phase), curve holds period, amplitude, phase, bias
+        float Evaluate(int shape, vec4 curve)
+        {
+            float x = time / curve.x + curve.z;
+            float y = shape == 1 ? sin(6.28318531 * x) : shape == 2 ? fract(x) : shape == 3 ? pow(1.0 - fract(x), 4.0) : 0.0;
+            return curve.w + curve.y * y;
+        }
+        
+        // Part of the pixel covered by the shape. edge is linear in every fan triangle, so its
+        // distance to 1 over its screen space gradient is the distance to the outline in pixels.
+        float Coverage()
+        {
+            if (!analyticCoverage) return 1.0;
+            return clamp((1.0 - edge) / max(length(vec2(dFdx(edge), dFdy(edge))), 1e-6) + 0.5, 0.0, 1.0);
+        }
         out vec4 fragmentColor;        // output that goes to the raster memory as told by glBindFragDataLocation
         
         void main()
         {
             float li = mix(modelSpacePos.x, modelSpacePos.y, 0.5);
-            if (fract(li * size) < 0.5 )
-                fragmentColor = vec4(scolor, 1);
+            if (fract(li * size + Evaluate(scrollShape, scroll)) < 0.5 )
+                fragmentColor = vec4(scolor, Coverage());
             else
-                fragmentColor = vec4(color, 1);
+                fragmentColor = vec4(color, Coverage());
         }
         )";
         
-        CompileShader(vertexSource, fragmentSource);
-        
-        // connect Attrib Array to input variables of the vertex shader
-        glBindAttribLocation(shaderProgram, 0, "vertexPosition"); // vertexPosition gets values from Attrib Array 0
-        
-        // connect the fragmentColor to the frame buffer memory
-        glBindFragDataLocation(shaderProgram, 0, "fragmentColor"); // fragmentColor goes to the frame buffer memory
-        
-        LinkShader();
-        
+        Build(vertexSource, fragmentSource, true);
     }
     
     void UploadColor(vec4 color) {
-        int location = glGetUniformLocation(shaderProgram, "vertexColor");
+        int location = GetUniformLocation("vertexColor");
         if (location >= 0) glUniform3fv(location, 1, &color.v[0]);
-        else printf("uniform vertex color cannot be set\n");
+        else if (!IsInstanced()) printf("uniform vertex color cannot be set\n");
     }
     
     void UploadStripeColor(vec4 stripeColor) {
-        int location = glGetUniformLocation(shaderProgram, "stripeColor");
+        int location = GetUniformLocation("stripeColor");
         if (location >= 0) glUniform3fv(location, 1, &stripeColor.v[0]);
-        else printf("uniform stripe color cannot be set\n");
+        else if (!IsInstanced()) printf("uniform stripe color cannot be set\n");
     }
     
     //glUniform1f float
     //glUniform1i int
     void UploadStripeSize(float size) {
-        int location = glGetUniformLocation(shaderProgram, "stripeSize");
+        int location = GetUniformLocation("stripeSize");
         if (location >= 0) glUniform1f(location, size);
-        else printf("uniform stripe size cannot be set\n");
+        else if (!IsInstanced()) printf("uniform stripe size cannot be set\n");
+    }
+    
+    void UploadScroll(AnimationCurve scroll) {
+        UploadCurve("scroll", "scrollShape", scroll);
     }
     
     
     void UploadM(mat4 M) {
-        int location = glGetUniformLocation(shaderProgram, "M");
+        int location = GetUniformLocation("M");
         if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, M);
-        else printf("uniform M cannot be set\n");
-    }
-    
-    void UploadSelected(bool selected) {
-        int location = glGetUniformLocation(shaderProgram, "selected");
-        if (location >= 0) glUniform1i(location, selected);
-        else printf("uniform selected boolean cannot be set\n");
+        else if (!IsInstanced()) printf("uniform M cannot be set\n");
     }
     
 };
@@ -396,7 +1336,7 @@ class HeartbeatShader : public Shader
 {
     
 public:
-    HeartbeatShader()
+    HeartbeatShader() : Shader("heartbeat")
     {
         // vertex shader in GLSL
         const char *vertexSource = R"(
@@ -404,23 +1344,31 @@ public:
         precision highp float;
         
         in vec2 vertexPosition;        // variable input from Attrib Array selected by glBindAttribLocation
+#ifdef INSTANCED
+        in vec4 instanceTransform;     // model-view rows (m00, m01, m10, m11)
+        in vec4 instanceTranslation;   // model-view translation, depth
+        in vec3 instanceColor;
+        uniform vec4 view;             // scale and offset applied after the instance transformation
+#else
         uniform vec3 vertexColor;
         uniform mat4 M;
-        uniform float t;
-        uniform bool selected;
+#endif
         out vec3 color;            // output attribute
-        out float time;
+        out float edge;            // 0 at the center of the triangle fan, 1 on its outline
         
         void main()
         {
-            if (selected) {
-                color = vec3(1,1,1);
-            }
-            else {
-                color = vertexColor;
-            }
-            time = t;
+#ifdef INSTANCED
+            vec3 vertexColor = instanceColor;
+#endif
+            color = vertexColor;
+#ifdef INSTANCED
+            gl_Position = vec4((vertexPosition.x * instanceTransform.xy + vertexPosition.y * instanceTransform.zw +
+                                instanceTranslation.xy) * view.xy + view.zw, instanceTranslation.z, 1);
+#else
             gl_Position = vec4(vertexPosition.x, vertexPosition.y, 0, 1) * M;      // copy position from input to output
+#endif
+            edge = gl_VertexID == 0 ? 0.0 : 1.0;
         }
         )";
         
@@ -430,55 +1378,132 @@ public:
         precision highp float;
         
         in vec3 color;            // variable input: interpolated from the vertex colors
-        in float time;
+        in float edge;
+        uniform bool analyticCoverage;
+        uniform vec4 pulse;            // how far the color moves towards the beat color
+        uniform int pulseShape;
+        uniform vec4 cycle;            // green of the beat color
+        uniform int cycleShape;
+        layout(std140) uniform Frame
+        {
+            float time;                // seconds, the same for all programs
+        };
+        
+        // bias + amplitude * shape(time / period + phase), curve holds period, amplitude, phase, bias
+        float Evaluate(int shape, vec4 curve)
+        {
+            float x = time / curve.x + curve.z;
+            float y = shape == 1 ? sin(6.28318531 * x) : shape == 2 ? fract(x) : shape == 3 ? pow(1.0 - fract(x), 4.0) : 0.0;
+            return curve.w + curve.y * y;
+        }
+        
+        // Part of the pixel covered by the shape. edge is linear in every fan triangle, so its
+        // distance to 1 over its screen space gradient is the distance to the outline in pixels.
+        float Coverage()
+        {
+            if (!analyticCoverage) return 1.0;
+            return clamp((1.0 - edge) / max(length(vec2(dFdx(edge), dFdy(edge))), 1e-6) + 0.5, 0.0, 1.0);
+        }
         out vec4 fragmentColor;        // output that goes to the raster memory as told by glBindFragDataLocation
         
         void main()
         {
-            vec4 color1 = vec4(1.0, (sin(time) / 2.0f + 0.5f), 1.0, 1.0);
-            float a = time - int(time);
+            vec4 color1 = vec4(1.0, Evaluate(cycleShape, cycle), 1.0, 1.0);
+            float a = Evaluate(pulseShape, pulse);
             fragmentColor = mix(vec4(color, 1), color1, a);
+            fragmentColor.a = Coverage();
         }
         )";
         
-        CompileShader(vertexSource, fragmentSource);
-        
-        // connect Attrib Array to input variables of the vertex shader
-        glBindAttribLocation(shaderProgram, 0, "vertexPosition"); // vertexPosition gets values from Attrib Array 0
-        
-        // connect the fragmentColor to the frame buffer memory
-        glBindFragDataLocation(shaderProgram, 0, "fragmentColor"); // fragmentColor goes to the frame buffer memory
-        
-        LinkShader();
-        
+        Build(vertexSource, fragmentSource, true);
     }
     
     void UploadColor(vec4 color) {
-        int location = glGetUniformLocation(shaderProgram, "vertexColor");
+        int location = GetUniformLocation("vertexColor");
         if (location >= 0) glUniform3fv(location, 1, &color.v[0]); // set uniform variable vertexColor
-        else printf("uniform vertex color cannot be set\n");
+        else if (!IsInstanced()) printf("uniform vertex color cannot be set\n");
     }
     
     void UploadM(mat4 M) {
-        int location = glGetUniformLocation(shaderProgram, "M");
+        int location = GetUniformLocation("M");
         if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, M);
-        else printf("uniform M cannot be set\n");
+        else if (!IsInstanced()) printf("uniform M cannot be set\n");
     }
     
-    void UploadTime(float time) {
-        int location = glGetUniformLocation(shaderProgram, "t");
-        if (location >= 0) glUniform1f(location, time);
-        else printf("uniform stripe size cannot be set\n");
+    void UploadPulse(AnimationCurve pulse) {
+        UploadCurve("pulse", "pulseShape", pulse);
     }
     
-    void UploadSelected(bool selected) {
-        int location = glGetUniformLocation(shaderProgram, "selected");
-        if (location >= 0) glUniform1i(location, selected);
-        else printf("uniform selected boolean cannot be set\n");
+    void UploadColorCycle(AnimationCurve cycle) {
+        UploadCurve("cycle", "cycleShape", cycle);
+    }
+    
+};
+
+// Four floats that the software rasterizer processes at once, in an SSE2 register where available.
+struct float4
+{
+#if SOFTWARE_SIMD
+    __m128 v;
+    
+    float4(__m128 v) : v(v) {}
+    float4(float a) : v(_mm_set1_ps(a)) {}
+    float4(float a, float b, float c, float d) : v(_mm_setr_ps(a, b, c, d)) {}
+    
+    float4 operator+(float4 b) const { return _mm_add_ps(v, b.v); }
+    float4 operator-(float4 b) const { return _mm_sub_ps(v, b.v); }
+    float4 operator*(float4 b) const { return _mm_mul_ps(v, b.v); }
+    
+    // SSE2 has no rounding instruction: truncate, then step down where that rounded up
+    float4 Floor() const {
+        __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(v));
+        return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, v), _mm_set1_ps(1)));
     }
     
+    // comparisons return a bit per lane, lane 0 in bit 0
+    int Less(float4 b) const { return _mm_movemask_ps(_mm_cmplt_ps(v, b.v)); }
+    int Greater(float4 b) const { return _mm_movemask_ps(_mm_cmpgt_ps(v, b.v)); }
+    int GreaterEqual(float4 b) const { return _mm_movemask_ps(_mm_cmpge_ps(v, b.v)); }
+#else
+    float v[4];
+    
+    float4(float a) { v[0] = v[1] = v[2] = v[3] = a; }
+    float4(float a, float b, float c, float d) { v[0] = a; v[1] = b; v[2] = c; v[3] = d; }
+    
+    float4 operator+(float4 b) const { return float4(v[0] + b.v[0], v[1] + b.v[1], v[2] + b.v[2], v[3] + b.v[3]); }
+    float4 operator-(float4 b) const { return float4(v[0] - b.v[0], v[1] - b.v[1], v[2] - b.v[2], v[3] - b.v[3]); }
+    float4 operator*(float4 b) const { return float4(v[0] * b.v[0], v[1] * b.v[1], v[2] * b.v[2], v[3] * b.v[3]); }
+    
+    float4 Floor() const { return float4(floorf(v[0]), floorf(v[1]), floorf(v[2]), floorf(v[3])); }
+    
+    int Less(float4 b) const { return (v[0] < b.v[0]) | (v[1] < b.v[1]) << 1 | (v[2] < b.v[2]) << 2 | (v[3] < b.v[3]) << 3; }
+    int Greater(float4 b) const { return b.Less(*this); }
+    int GreaterEqual(float4 b) const { return ~Less(b) & 15; }
+#endif
 };
 
+// RGBA8 laid out like glReadPixels with GL_RGBA and GL_UNSIGNED_BYTE returns it on little endian machines
+unsigned int PackColor(vec4 c) {
+    unsigned int packed = 0;
+    for (int i = 0; i < 4; i++) packed |= (unsigned int)(fmin(fmax(c.v[i], 0), 1) * 255 + 0.5f) << (8 * i);
+    return packed;
+}
+
+// formats printf style into a string, for the vector export
+std::string Format(const char* format, ...) {
+    char buffer[512];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    return std::string(buffer, (int)fmin(fmax(length, 0), sizeof(buffer) - 1));
+}
+
+std::string SvgColor(vec4 c) {
+    unsigned int packed = PackColor(c);
+    return Format("#%02x%02x%02x", packed & 255, packed >> 8 & 255, packed >> 16 & 255);
+}
+
 class Material {
     
     Shader* shader;
@@ -486,10 +1511,66 @@ class Material {
 public:
     Material(Shader* shader) : shader(shader) {}
     
+    Shader* GetShader() {
+        return shader;
+    }
+    
+    // base color, which the instanced programs get per instance instead of as a uniform
+    virtual vec4 GetColor() { return vec4(1, 1, 1); }
+    
     virtual void UploadAttributes() {}
     virtual void SetSelected(bool b) {}
+    
+    // animated materials change every frame, so the scene has to keep redrawing while they are visible
+    virtual bool IsAnimated() { return false; }
+    
+    // The fragment shader on the CPU for the software rasterizer: colors count pixels of a row as
+    // packed RGBA8, the first at model space position p and each further one step away.
+    virtual void ShadeSpan(vec2 p, vec2 step, int count, float time, unsigned int* out) {
+        std::fill(out, out + count, PackColor(GetColor()));
+    }
+    
+    // The fill of the material at time in an SVG export. Patterns are appended to definitions under
+    // id and referenced, so all items with the material share one definition.
+    virtual std::string GetSvgPaint(const std::string& id, float time, std::string& definitions) {
+        return SvgColor(GetColor());
+    }
 };
 
+// the stripes fragment shader for a span of pixels, four at a time
+void ShadeStripes(vec4 color, vec4 stripeColor, float stripeSize, float scroll, vec2 p, vec2 step, int count,
+                  unsigned int* out) {
+    unsigned int base = PackColor(color), stripe = PackColor(stripeColor);
+    // li * size + scroll with li = mix(x, y, 0.5) changes linearly along the span
+    float start = (p.x + p.y) * 0.5f * stripeSize + scroll, delta = (step.x + step.y) * 0.5f * stripeSize;
+    float4 lanes = float4(start) + float4(0, 1, 2, 3) * float4(delta);
+    float4 stride(4 * delta), half(0.5f);
+    for (int i = 0; i < count; i += 4) {
+        int stripes = (lanes - lanes.Floor()).Less(half);
+        for (int j = 0; j < 4 && i + j < count; j++) out[i + j] = stripes >> j & 1 ? stripe : base;
+        lanes = lanes + stride;
+    }
+}
+
+// The stripes as an SVG pattern in model space. The stripes repeat every 2 / stripeSize along both
+// axes, so one square tile holds a diagonal band per stripe.
+std::string SvgStripes(const std::string& id, vec4 color, vec4 stripeColor, float stripeSize, float scroll,
+                       std::string& definitions) {
+    float tile = 2 / stripeSize, far = 3 * tile;
+    definitions += Format("<pattern id=\"%s\" patternUnits=\"userSpaceOnUse\" width=\"%g\" height=\"%g\">"
+                          "<rect width=\"%g\" height=\"%g\" fill=\"%s\"/>", id.c_str(), tile, tile, tile, tile,
+                          SvgColor(color).c_str());
+    scroll -= floorf(scroll);
+    for (int n = -1; n <= 2; n++) {
+        // x + y between a and b, where the fraction of (x + y) / tile + scroll is below one half
+        float a = (n - scroll) * tile, b = a + 0.5f * tile;
+        definitions += Format("<polygon points=\"%g,%g %g,%g %g,%g %g,%g\" fill=\"%s\"/>", a + far, -far, -far,
+                              a + far, -far, b + far, b + far, -far, SvgColor(stripeColor).c_str());
+    }
+    definitions += "</pattern>\n";
+    return "url(#" + id + ")";
+}
+
 class StandardMaterial : public Material {
     
     StandardShader* shader;
@@ -498,6 +1579,10 @@ class StandardMaterial : public Material {
 public:
     StandardMaterial(StandardShader* shader, vec4 color) : Material(shader), shader(shader), color(color) {}
     
+    vec4 GetColor() {
+        return color;
+    }
+    
     void UploadAttributes() {
         shader->UploadColor(color);
     }
@@ -517,10 +1602,23 @@ public:
         stripeSize = 1.0;
     }
     
+    vec4 GetColor() {
+        return color;
+    }
+    
     void UploadAttributes() {
         shader->UploadColor(color);
         shader->UploadStripeColor(stripeColor);
         shader->UploadStripeSize(stripeSize);
+        shader->UploadScroll(AnimationCurve());
+    }
+    
+    void ShadeSpan(vec2 p, vec2 step, int count, float time, unsigned int* out) {
+        ShadeStripes(color, stripeColor, stripeSize, 0, p, step, count, out);
+    }
+    
+    std::string GetSvgPaint(const std::string& id, float time, std::string& definitions) {
+        return SvgStripes(id, color, stripeColor, stripeSize, 0, definitions);
     }
 };
 
@@ -530,18 +1628,42 @@ class NarrowCyanStripes : public Material {
     vec4 color;
     vec4 stripeColor;
     float stripeSize;
+    AnimationCurve scroll;
+    
+    // the scroll curve while scrolling is turned on
+    AnimationCurve GetScroll() {
+        return scrollStripes ? scroll : AnimationCurve();
+    }
     
 public:
     NarrowCyanStripes(StripesShader* shader, vec4 color) :
     Material(shader), shader(shader), color(color) {
         stripeColor = vec4(0, 1, 1);
         stripeSize = 5.0;
+        scroll = AnimationCurve(AnimationCurve::Sawtooth, 2, 1);    // one stripe every two seconds, see scrollStripes
+    }
+    
+    vec4 GetColor() {
+        return color;
     }
     
     void UploadAttributes() {
         shader->UploadColor(color);
         shader->UploadStripeColor(stripeColor);
         shader->UploadStripeSize(stripeSize);
+        shader->UploadScroll(GetScroll());
+    }
+    
+    bool IsAnimated() {
+        return GetScroll().IsAnimated();
+    }
+    
+    void ShadeSpan(vec2 p, vec2 step, int count, float time, unsigned int* out) {
+        ShadeStripes(color, stripeColor, stripeSize, GetScroll().Evaluate(time), p, step, count, out);
+    }
+    
+    std::string GetSvgPaint(const std::string& id, float time, std::string& definitions) {
+        return SvgStripes(id, color, stripeColor, stripeSize, GetScroll().Evaluate(time), definitions);
     }
 };
 
@@ -549,48 +1671,90 @@ class HeartbeatMaterial : public Material {
     
     HeartbeatShader* shader;
     vec4 color;
+    AnimationCurve pulse;
+    AnimationCurve cycle;
+    
+    // the color does not depend on the position
+    vec4 GetBeat(float time) {
+        float a = pulse.Evaluate(time), green = cycle.Evaluate(time);
+        return vec4(color.v[0] + (1 - color.v[0]) * a, color.v[1] + (green - color.v[1]) * a,
+                    color.v[2] + (1 - color.v[2]) * a);
+    }
     
 public:
-    HeartbeatMaterial(HeartbeatShader* shader, vec4 color) : Material(shader), shader(shader), color(color) {}
+    HeartbeatMaterial(HeartbeatShader* shader, vec4 color) : Material(shader), shader(shader), color(color) {
+        pulse = AnimationCurve(AnimationCurve::Sawtooth, 1, 1);                         // one beat per second
+        cycle = AnimationCurve(AnimationCurve::Sine, 2 * (float)M_PI, 0.5f, 0, 0.5f);
+    }
+    
+    vec4 GetColor() {
+        return color;
+    }
     
+    // the curves only change with the material, the time comes from the frame uniforms
     void UploadAttributes() {
         shader->UploadColor(color);
-        float time = glutGet(GLUT_ELAPSED_TIME) * 0.001;
-        shader->UploadTime(time);
+        shader->UploadPulse(pulse);
+        shader->UploadColorCycle(cycle);
     }
     
+    bool IsAnimated() {
+        return true;
+    }
+    
+    void ShadeSpan(vec2 p, vec2 step, int count, float time, unsigned int* out) {
+        std::fill(out, out + count, PackColor(GetBeat(time)));
+    }
+    
+    std::string GetSvgPaint(const std::string& id, float time, std::string& definitions) {
+        return SvgColor(GetBeat(time));
+    }
 };
 
 class Geometry{
     
 protected: unsigned int vao;    // vertex array object id
+    unsigned int vbo;           // vertex buffer object
+    unsigned int primitive;     // primitive type and number of vertices, set by the subclasses
+    int vertexCount;
+    std::vector<vec2> outline;  // perimeter in model space for collision tests, empty if unknown
+    std::vector<vec2> triangles;    // the primitive as a triangle list, drawn by the software rasterizer
+    vec2 lower, upper;          // bounding box in model space
     
-public:
-    Geometry(){
-        glGenVertexArrays(1, &vao);    // create a vertex array object
+    // takes count perimeter points from interleaved x, y coordinates
+    void SetOutline(const float* coords, int count) {
+        outline.resize(count);
+        for (int i = 0; i < count; i++) outline[i] = vec2(coords[2 * i], coords[2 * i + 1]);
     }
     
-    virtual void Draw() = 0;
-};
-
-class Triangle : public Geometry
-{
-    unsigned int vbo;        // vertex buffer object
-    
-public:
-    Triangle()
-    {
-        glBindVertexArray(vao);        // make it active
+    // Takes count vertices of the primitive from interleaved x, y coordinates. They are kept as a
+    // triangle list on the CPU and copied to a vertex buffer unless there is no OpenGL context.
+    void SetVertices(const float* coords, int count) {
+        vertexCount = count;
+        triangles.clear();
+        for (int i = 2; i < count; i++) {
+            if (primitive == GL_TRIANGLES && i % 3 != 2) continue;
+            int first = primitive == GL_TRIANGLE_FAN ? 0 : i - 2;
+            triangles.push_back(vec2(coords[2 * first], coords[2 * first + 1]));
+            triangles.push_back(vec2(coords[2 * i - 2], coords[2 * i - 1]));
+            triangles.push_back(vec2(coords[2 * i], coords[2 * i + 1]));
+        }
+        lower = vec2(1e30f, 1e30f);
+        upper = vec2(-1e30f, -1e30f);
+        for (int i = 0; i < count; i++) {
+            lower = vec2(fmin(lower.x, coords[2 * i]), fmin(lower.y, coords[2 * i + 1]));
+            upper = vec2(fmax(upper.x, coords[2 * i]), fmax(upper.y, coords[2 * i + 1]));
+        }
+        if (softwareOnly) return;
         
-        glGenBuffers(1, &vbo);        // generate a vertex buffer object
+        glBindVertexArray(vao);        // make it active
+        if (!vbo) glGenBuffers(1, &vbo);        // generate a vertex buffer object once, later calls refill it
         
         // vertex coordinates: vbo -> Attrib Array 0 -> vertexPosition of the vertex shader
         glBindBuffer(GL_ARRAY_BUFFER, vbo); // make it active, it is an array
-        static float vertexCoords[] = { 0, 0, 1, 0, 0, 1 };    // vertex data on the CPU
-        
         glBufferData(GL_ARRAY_BUFFER,    // copy to the GPU
-                     sizeof(vertexCoords),    // size of the vbo in bytes
-                     vertexCoords,        // address of the data array on the CPU
+                     count * 2 * sizeof(float),    // size of the vbo in bytes
+                     coords,        // address of the data array on the CPU
                      GL_STATIC_DRAW);    // copy to that part of the memory which is not modified
         
         // map Attribute Array 0 to the currently bound vertex buffer (vbo)
@@ -603,41 +1767,114 @@ public:
                               0, NULL);        // stride and offset: it is tightly packed
     }
     
+public:
+    Geometry(){
+        vao = vbo = 0;
+        if (!softwareOnly) glGenVertexArrays(1, &vao);    // create a vertex array object
+        primitive = GL_TRIANGLES;
+        vertexCount = 0;
+    }
+    
+    // run by the arena when the scene is torn down, the GL names are released with the geometry
+    virtual ~Geometry() {
+        if (softwareOnly) return;
+        if (vbo) glDeleteBuffers(1, &vbo);
+        if (vao) glDeleteVertexArrays(1, &vao);
+    }
+    
+    virtual void Draw() = 0;
+    
+    // the shape in model space as SVG elements, by default the triangles of the primitive
+    virtual std::string GetSvgShape() {
+        std::string path = "<path d=\"";
+        for (int i = 0; i < triangles.size(); i += 3) {
+            path += Format("M%g %gL%g %gL%g %gZ", triangles[i].x, triangles[i].y, triangles[i + 1].x,
+                           triangles[i + 1].y, triangles[i + 2].x, triangles[i + 2].y);
+        }
+        return path + "\"/>";
+    }
+    
+    static std::string SvgPolygon(const std::vector<vec2>& points) {
+        std::string polygon = "<polygon points=\"";
+        for (int i = 0; i < points.size(); i++) polygon += Format(i ? " %g,%g" : "%g,%g", points[i].x, points[i].y);
+        return polygon + "\"/>";
+    }
+    
+    const std::vector<vec2>& GetOutline() {
+        return outline;
+    }
+    
+    const std::vector<vec2>& GetTriangles() {
+        return triangles;
+    }
+    
+    vec2 GetLower() {
+        return lower;
+    }
+    
+    vec2 GetUpper() {
+        return upper;
+    }
+    
+    // draws count instances whose InstanceData starts at offset in buffer
+    void DrawInstanced(unsigned int buffer, size_t offset, int count)
+    {
+        glBindVertexArray(vao);
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        for (int i = 0; i < instanceAttributeCount; i++) {
+            glEnableVertexAttribArray(1 + i);
+            glVertexAttribPointer(1 + i, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+                                  (void*)(offset + i * 4 * sizeof(float)));
+            glVertexAttribDivisor(1 + i, 1);
+        }
+        glDrawArraysInstanced(primitive, 0, vertexCount, count);
+        profiler.CountStateChange();
+        profiler.CountDraw(vertexCount * count);
+    }
+};
+
+class Triangle : public Geometry
+{
+    
+public:
+    Triangle()
+    {
+        static float vertexCoords[] = { 0, 0, 1, 0, 0, 1 };    // vertex data on the CPU
+        primitive = GL_TRIANGLES;
+        SetVertices(vertexCoords, 3);
+    }
+    
     void Draw()
     {
         glBindVertexArray(vao);    // make the vao and its vbos active playing the role of the data source
         glDrawArrays(GL_TRIANGLES, 0, 3); // draw a single triangle with vertices defined in vao
+        profiler.CountStateChange();
+        profiler.CountDraw(3);
     }
 };
 
 class Quad : public Geometry
 {
-    unsigned int vbo;
     
 public:
     Quad()
     {
-        glBindVertexArray(vao);
-        
-        glGenBuffers(1, &vbo);
-        
-        glBindBuffer(GL_ARRAY_BUFFER, vbo);
         static float vertexCoords[] = { 0, 0, 1, 0, 0, 1, 1, 1};
-        glBufferData(GL_ARRAY_BUFFER, sizeof(vertexCoords), vertexCoords, GL_STATIC_DRAW);
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+        primitive = GL_TRIANGLE_STRIP;
+        SetVertices(vertexCoords, 4);
     }
     
     void Draw()
     {
         glBindVertexArray(vao);
         glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        profiler.CountStateChange();
+        profiler.CountDraw(4);
     }
 };
 
 class RoundTable : public Geometry
 {
-    unsigned int vbo;
     int res = 30;
     float radius = 1;
     
@@ -658,25 +1895,28 @@ public:
             theta += 360/res;
         }
         
-        glBindVertexArray(vao);
-        glGenBuffers(1, &vbo);
-        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        SetOutline(vertexCoords + 2, res);     // the fan without its center and closing vertex
         
-        glBufferData(GL_ARRAY_BUFFER, sizeof(vertexCoords), vertexCoords, GL_STATIC_DRAW);
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+        primitive = GL_TRIANGLE_FAN;
+        SetVertices(vertexCoords, res+2);
     }
     
     void Draw()
     {
         glBindVertexArray(vao);
         glDrawArrays(GL_TRIANGLE_FAN, 0, res+2);
+        profiler.CountStateChange();
+        profiler.CountDraw(res+2);
+    }
+    
+    std::string GetSvgShape()
+    {
+        return Format("<circle r=\"%g\"/>", radius);
     }
 };
 
 class Plant : public Geometry
 {
-    unsigned int vbo;
     int res = 10;
     float radius = 1;
     
@@ -703,25 +1943,28 @@ public:
             theta += 360/res;
         }
         
-        glBindVertexArray(vao);
-        glGenBuffers(1, &vbo);
-        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        SetOutline(vertexCoords + 2, res);     // the fan without its center and closing vertex
         
-        glBufferData(GL_ARRAY_BUFFER, sizeof(vertexCoords), vertexCoords, GL_STATIC_DRAW);
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+        primitive = GL_TRIANGLE_FAN;
+        SetVertices(vertexCoords, res+2);
     }
     
     void Draw()
     {
         glBindVertexArray(vao);
         glDrawArrays(GL_TRIANGLE_FAN, 0, res+2);
+        profiler.CountStateChange();
+        profiler.CountDraw(res+2);
+    }
+    
+    std::string GetSvgShape()
+    {
+        return SvgPolygon(outline);
     }
 };
 
 class CoatRack : public Geometry
 {
-    unsigned int vbo;
     float k;
     int res;
     
@@ -746,19 +1989,30 @@ public:
             theta += 360.0/res;
         }
         
-        glBindVertexArray(vao);
-        glGenBuffers(1, &vbo);
-        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        SetOutline(vertexCoords + 2, res);     // the fan without its center and closing vertex
         
-        glBufferData(GL_ARRAY_BUFFER, sizeof(vertexCoords), vertexCoords, GL_STATIC_DRAW);
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+        primitive = GL_TRIANGLE_FAN;
+        SetVertices(vertexCoords, res+2);
     }
     
     void Draw()
     {
         glBindVertexArray(vao);
         glDrawArrays(GL_TRIANGLE_FAN, 0, res+2);
+        profiler.CountStateChange();
+        profiler.CountDraw(res+2);
+    }
+    
+    // the rose curve r = cos(k theta), sampled more finely than the fan
+    std::string GetSvgShape()
+    {
+        std::vector<vec2> points(4 * res);
+        for (int i = 0; i < points.size(); i++) {
+            float theta = 2 * (float)M_PI * i / points.size();
+            float radius = cosf(k * theta);
+            points[i] = vec2(radius * cosf(theta), radius * sinf(theta));
+        }
+        return SvgPolygon(points);
     }
 };
 
@@ -766,11 +2020,28 @@ class Mesh{
     
     Geometry *geometry;
     Material *material;
+    int index = 0;      // position in the mesh list of the scene, used to batch instances
     
 public:
     Mesh(Geometry *geometry,
          Material *material) : geometry(geometry), material(material) {}
     
+    Material* GetMaterial() {
+        return material;
+    }
+    
+    Geometry* GetGeometry() {
+        return geometry;
+    }
+    
+    int GetIndex() {
+        return index;
+    }
+    
+    void SetIndex(int i) {
+        index = i;
+    }
+    
     void Draw() {
         material->UploadAttributes();
         geometry->Draw();
@@ -799,7 +2070,33 @@ public:
         return M;
     }
     
-    void Move(double dt) {
+    void Set(vec2 center, float size) {
+        this->center = center;
+        this->horizontal_size = size;
+        this->vertical_size = size;
+    }
+    
+    // inverse of the view transformation for a point in normalized device coordinates
+    vec2 ScreenToWorld(vec2 p) {
+        return vec2((p.x + center.x) * horizontal_size, (p.y + center.y) * vertical_size);
+    }
+    
+    // true while one of the zoom or pan keys is held down
+    bool IsMoving() {
+        return keyboardState['z'] || keyboardState['x'] || keyboardState['i'] ||
+            keyboardState['k'] || keyboardState['l'] || keyboardState['j'];
+    }
+    
+    // conservative test whether a circle of the given radius around p ends up inside the viewport
+    bool IsVisible(vec2 p, float radius) {
+        float x = p.x / horizontal_size - center.x;
+        float y = p.y / vertical_size - center.y;
+        return fabs(x) <= 1 + radius / horizontal_size && fabs(y) <= 1 + radius / vertical_size;
+    }
+    
+    // returns true if the view has changed and has to be redrawn
+    bool Move(double dt) {
+        if (!IsMoving()) return false;
         if (keyboardState['z']) {
             this->horizontal_size = horizontal_size - dt;
             this->vertical_size = horizontal_size - dt;
@@ -820,7 +2117,7 @@ public:
         if (keyboardState['j']) {
             this->center.x = center.x - dt;
         }
-        glutPostRedisplay();
+        return true;
     }
 };
 
@@ -832,14 +2129,26 @@ class Object{
     vec2 position, scaling;
     vec2 offset_position = vec2(0, 0);
     float orientation;
-    float offset_orientation;
+    float offset_orientation = 0;
     bool selected = false;
     
+    // position, scaling and orientation are relative to the parent, world is the combined model
+    // matrix of the object and all of its parents as of the last Scene::UpdateTransforms
+    Object* parent = 0;
+    mat4 world;
+    bool dirty = true;          // the local transformation changed since the last update
+    bool worldChanged = false;  // world was recomputed in the current update pass
+    
 public:
+    bool deleted = false;       // scratch flag of Scene::DeleteSelected
+    int treeIndex = 0;          // position in the depth first order of Scene, its subtree follows it
+    bool conflict = false;      // overlaps another item, set by the collision checks
+    
     Object(Shader *shader, Mesh *mesh, vec2 position, vec2 scaling, float orientation) :
     shader(shader), mesh(mesh), position(position), scaling(scaling), orientation(orientation) {}
     
-    void UploadAttributes() {
+    // local scaling, rotation, and translation; touches no GL state so it can run on any thread
+    mat4 GetModelMatrix() {
         mat4 S = {scaling.x,0,0,0,
             0,scaling.y,0,0,
             0,0,1,0,
@@ -856,17 +2165,72 @@ public:
             0,0,1,0,
             position.x+offset_position.x, position.y+offset_position.y,0,1};
         
+        return S * R * T;
+    }
+    
+    mat4 GetWorldMatrix() {
+        return world;
+    }
+    
+    // Recomputes the world matrix if this object or one of its parents moved. The parent has to be
+    // updated earlier in the same pass, so untouched subtrees cost a flag check per object.
+    void UpdateWorld() {
+        worldChanged = dirty || (parent && parent->worldChanged);
+        if (!worldChanged) return;
+        world = parent ? GetModelMatrix() * parent->world : GetModelMatrix();
+        dirty = false;
+    }
+    
+    Object* GetParent() {
+        return parent;
+    }
+    
+    // the local transformation is interpreted relative to the parent from now on
+    void SetParent(Object* p) {
+        parent = p;
+        dirty = true;
+    }
+    
+    Object* GetRoot() {
+        Object* root = this;
+        while (root->parent) root = root->parent;
+        return root;
+    }
+    
+    // converts a translation in world space to the space the local position is given in
+    vec2 ToParentSpace(vec2 v) {
+        if (!parent) return v;
+        mat4& m = parent->world;
+        float det = m.m[0][0] * m.m[1][1] - m.m[0][1] * m.m[1][0];
+        if (det == 0) return v;
+        return vec2((v.x * m.m[1][1] - v.y * m.m[1][0]) / det, (v.y * m.m[0][0] - v.x * m.m[0][1]) / det);
+    }
+    
+    void UploadAttributes() {
         mat4 V = camera.GetViewTransformationMatrix();
-        mat4 M = S * R * T * V; // scaling, rotation, and translation
+        mat4 M = GetWorldMatrix() * V; // scaling, rotation, and translation
         shader->UploadM(M);
-        shader->UploadSelected(selected);
-        
     }
     
     Shader* GetShader() {
         return shader;
     }
     
+    Mesh* GetMesh() {
+        return mesh;
+    }
+    
+    // geometries are built around the origin with unit radius, so the scaling bounds the footprint
+    float GetBoundingRadius() {
+        return sqrtf(fmax(world.m[0][0] * world.m[0][0] + world.m[0][1] * world.m[0][1],
+                          world.m[1][0] * world.m[1][0] + world.m[1][1] * world.m[1][1]));
+    }
+    
+    // position in world space including the drag offset
+    vec2 GetDrawPosition() {
+        return vec2(world.m[3][0], world.m[3][1]);
+    }
+    
     void SetSelected(bool b) {
         selected = b;
     }
@@ -875,13 +2239,22 @@ public:
         return selected;
     }
     
+    // selected objects inside a selected group follow their parent instead of moving on their own
+    bool IsEditable() {
+        return selected && !(parent && parent->selected);
+    }
+    
+    // p is a translation in world space, like the mouse offset
     void SetOffsetPosition(vec2 p) {
-        offset_position = p;
+        offset_position = ToParentSpace(p);
+        dirty = true;
     }
     
     void SetPosition(vec2 p) {
+        p = ToParentSpace(p);
         position = vec2(position.x + p.x, position.y + p.y);
         offset_position = vec2(0, 0);
+        dirty = true;
     }
     
     vec2 GetPosition() {
@@ -890,6 +2263,7 @@ public:
     
     void SetOrientation(double t) {
         offset_orientation = offset_orientation + (float)t*200;
+        dirty = true;
     }
     
     void Draw() {
@@ -898,275 +2272,5002 @@ public:
     }
 };
 
-class Scene {
-    StandardShader* shader;
-    StripesShader* shader2;
-    HeartbeatShader* shader3;
-    std::vector<Material*> materials;
-    std::vector<Geometry*> geometries;
-    std::vector<Mesh*> meshes;
-    std::vector<Object*> objects;
+// everything the GL thread needs to draw one object, prepared on the worker threads
+struct DrawCommand
+{
+    Shader* shader;
+    Mesh* mesh;
+    mat4 M;             // model and view transformation
+};
+
+// Draw commands in painter's order. Building happens in parallel chunks, submitting the
+// commands to OpenGL is done by the thread that owns the context.
+class CommandList
+{
+    std::vector<std::vector<DrawCommand>> chunks;
+    
 public:
-    Scene() {
-        shader = 0;
-        shader2 = 0;
-        shader3 = 0;
+    void Resize(int count) {
+        chunks.resize(count);
     }
-    void Initialize() {
-        
-        shader = new StandardShader();
-        shader2 = new StripesShader();
-        shader3 = new HeartbeatShader();
-        
-        materials.push_back(new StandardMaterial(shader, vec4(1, 0, 0)));
-        materials.push_back(new StandardMaterial(shader, vec4(0, 1, 0)));
-        materials.push_back(new StandardMaterial(shader, vec4(0, 0, 1)));
-        
-        geometries.push_back(new RoundTable(1,30));
-        geometries.push_back(new Plant());
-        geometries.push_back(new CoatRack(4,80));
-        
-        meshes.push_back(new Mesh(geometries[0], materials[0]));
-        meshes.push_back(new Mesh(geometries[1], materials[1]));
-        meshes.push_back(new Mesh(geometries[2], materials[2]));
-        
-        objects.push_back(new Object(shader, meshes[0], vec2(-0.5, -0.5), vec2(0.5, 0.5), 10.0));
-        objects.push_back(new Object(shader, meshes[1], vec2(0.25, 0.5), vec2(0.5, 0.5), -30.0));
-        objects.push_back(new Object(shader, meshes[2], vec2(0, 0), vec2(0.5, 0.5), 0));
-        
-        materials.push_back(new WideRedStripes(shader2, vec4(1.0, 1.0, 0.5)));
-        geometries.push_back(new RoundTable(1,30));
-        meshes.push_back(new Mesh(geometries[3], materials[3]));
-        objects.push_back(new Object(shader2, meshes[3], vec2(0.5, -0.5), vec2(0.3, 0.3), 0));
-        
-        materials.push_back(new NarrowCyanStripes(shader2, vec4(1.0, 0.5, 0)));
-        geometries.push_back(new Plant());
-        meshes.push_back(new Mesh(geometries[4], materials[4]));
-        objects.push_back(new Object(shader2, meshes[4], vec2(0.9, 0), vec2(0.3, 0.3), 0));
-        
-        materials.push_back(new HeartbeatMaterial(shader3, vec4(0.5, 0, 0)));
-        geometries.push_back(new CoatRack(3,60));
-        meshes.push_back(new Mesh(geometries[5], materials[5]));
-        objects.push_back(new Object(shader3, meshes[5], vec2(-0.7, 0.7), vec2(0.8, 0.8), 0));
-        
+    
+    std::vector<DrawCommand>& GetChunk(int i) {
+        return chunks[i];
     }
     
-    std::vector<Material*> GetMaterials() {
-        return materials;
+    int GetCommandCount() {
+        int count = 0;
+        for (int i = 0; i < chunks.size(); i++) count += (int)chunks[i].size();
+        return count;
     }
     
-    void SetMaterials(std::vector<Material*> m) {
-        materials = m;
+    void Submit() {
+        Shader* current = 0;
+        for (int c = 0; c < chunks.size(); c++) {
+            std::vector<DrawCommand>& commands = chunks[c];
+            for (int i = 0; i < commands.size(); i++) {
+                // consecutive objects usually share the program, only switch when it changes
+                if (commands[i].shader != current) {
+                    current = commands[i].shader;
+                    current->Run();
+                }
+                current->UploadM(commands[i].M);
+                commands[i].mesh->Draw();
+            }
+        }
     }
+};
+
+CommandList commandList;
+
+// Triple-buffered vertex buffer for data that is rewritten every frame. With buffer storage it
+// stays persistently mapped and coherent, and each of the three regions is guarded by a fence, so
+// the CPU writes straight into GPU visible memory without ever touching data the GPU still reads.
+// Contexts without buffer storage write into a staging copy that is uploaded with glBufferSubData
+// after orphaning the buffer.
+class StreamBuffer
+{
+    static const int regions = 3;
     
-    std::vector<Geometry*> GetGeometries() {
-        return geometries;
+    unsigned int buffer;
+    size_t capacity;            // bytes per region
+    int region;
+    GLsync fences[regions];
+    char* mapped;
+    bool persistent;
+    std::vector<char> staging;
+    size_t used;
+    
+    void WaitFence(int i) {
+        if (!fences[i]) return;
+        while (glClientWaitSync(fences[i], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED) {}
+        glDeleteSync(fences[i]);
+        fences[i] = 0;
     }
     
-    void SetGeometries(std::vector<Geometry*> g) {
-        geometries = g;
+    void Allocate(size_t size) {
+        if (buffer) {
+            for (int i = 0; i < regions; i++) WaitFence(i);
+            glBindBuffer(GL_ARRAY_BUFFER, buffer);
+            if (mapped) glUnmapBuffer(GL_ARRAY_BUFFER);
+            glDeleteBuffers(1, &buffer);
+            mapped = 0;
+        }
+        capacity = size;
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+#if defined(GL_MAP_PERSISTENT_BIT)
+        if (persistent) {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_ARRAY_BUFFER, capacity * regions, NULL, flags);
+            mapped = (char*)glMapBufferRange(GL_ARRAY_BUFFER, 0, capacity * regions, flags);
+            if (mapped) return;
+            printf("Persistent mapping failed, falling back to buffer orphaning\n");
+            persistent = false;
+            glDeleteBuffers(1, &buffer);
+            glGenBuffers(1, &buffer);
+            glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        }
+#endif
+        staging.resize(capacity);
+        glBufferData(GL_ARRAY_BUFFER, capacity, NULL, GL_STREAM_DRAW);
     }
     
-    std::vector<Mesh*> GetMeshes() {
-        return meshes;
+public:
+    StreamBuffer() {
+        buffer = 0;
+        capacity = 0;
+        region = 0;
+        mapped = 0;
+        persistent = false;
+        used = 0;
+        for (int i = 0; i < regions; i++) fences[i] = 0;
     }
     
-    void SetMeshes(std::vector<Mesh*> m) {
-        meshes = m;
+    // needs a current OpenGL context; usePersistent is ignored without buffer storage support
+    void Initialize(bool usePersistent) {
+#if defined(GL_MAP_PERSISTENT_BIT)
+        persistent = usePersistent &&
+            (majorVersion > 4 || (majorVersion == 4 && minorVersion >= 4) || HasExtension("GL_ARB_buffer_storage"));
+#endif
+        Allocate(64 * 1024);
     }
     
-    std::vector<Object*> GetObjects() {
-        return objects;
+    bool IsPersistent() {
+        return persistent;
     }
     
-    void SetObjects(std::vector<Object*> o) {
-        objects = o;
+    // memory to write this frame's data to, valid until End
+    char* Begin(size_t size) {
+        if (size > capacity) Allocate((size_t)fmax(size, capacity * 2));
+        used = size;
+        if (!persistent) return &staging[0];
+        region = (region + 1) % regions;
+        WaitFence(region);
+        return mapped + region * capacity;
     }
     
-    ~Scene() {
-        for(int i = 0; i < materials.size(); i++) delete materials[i];
-        for(int i = 0; i < geometries.size(); i++) delete geometries[i];
-        for(int i = 0; i < meshes.size(); i++) delete meshes[i];
-        for(int i = 0; i < objects.size(); i++) delete objects[i];
-        if(shader) delete shader;
-        if(shader2) delete shader2;
-        if(shader3) delete shader3;
+    // makes the written data visible to OpenGL
+    void End() {
+        if (persistent) return;     // coherent mapping, nothing to flush
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        glBufferData(GL_ARRAY_BUFFER, capacity, NULL, GL_STREAM_DRAW);     // orphan the old storage
+        glBufferSubData(GL_ARRAY_BUFFER, 0, used, &staging[0]);
     }
     
-    void Draw()
-    {
-        for(int i = 0; i < objects.size(); i++) {
-            objects[i]->GetShader()->Run();
-            objects[i]->Draw();
-        }
+    // call after the draw calls that read this frame's region have been issued
+    void Fence() {
+        if (!persistent) return;
+        fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+    
+    unsigned int GetBuffer() {
+        return buffer;
+    }
+    
+    // byte offset of this frame's region in the buffer
+    size_t GetOffset() {
+        return persistent ? region * capacity : 0;
     }
 };
 
-Scene *gScene = 0;
-
-// initialization, create an OpenGL context
-void onInitialization()
+// Scratch state of the instanced renderer: visible objects and per mesh instance counts of every
+// chunk, and where each chunk writes its instances in the stream buffer.
+struct InstanceBatches
 {
-    glViewport(0, 0, windowWidth, windowHeight);
+    StreamBuffer stream;
+    std::vector<std::vector<int>> visible;  // object indices per chunk
+    std::vector<int> counts;                // per chunk and mesh, turned into write cursors
+    std::vector<int> batchCounts;           // instances per mesh
+    std::vector<int> batchOffsets;          // first instance of each mesh
     
-    gScene = new Scene();
-    gScene->Initialize();
-}
+    void Resize(int chunks, int meshes) {
+        visible.resize(chunks);
+        counts.assign(chunks * meshes, 0);
+        batchCounts.assign(meshes, 0);
+        batchOffsets.assign(meshes, 0);
+    }
+};
 
-void onExit()
+InstanceBatches instanceBatches;
+
+// Bump allocator for everything a scene owns. Allocations are carved out of a few large blocks and
+// never freed one by one: Reset releases the whole scene at once and only runs the destructors of
+// types that actually have one, so tearing down a plan does not depend on its number of objects.
+class Arena
 {
-    delete gScene;
-    printf("exit");
-}
+    struct Destructor
+    {
+        void* object;
+        void (*destroy)(void*);
+    };
+    
+    std::vector<char*> blocks;
+    std::vector<Destructor> destructors;
+    size_t blockSize;
+    char* current;
+    size_t remaining;
+    
+    void* Allocate(size_t size, size_t alignment) {
+        size_t padding = (alignment - (size_t)current % alignment) % alignment;
+        if (!current || padding + size > remaining) {
+            // blocks grow geometrically, so large scenes still need only a handful of them
+            blockSize = (size_t)fmin(fmax(blockSize * 2, size + alignment), 16 << 20);
+            if (blockSize < size + alignment) blockSize = size + alignment;
+            current = (char*)malloc(blockSize);
+            if (!current) { printf("Out of memory\n"); exit(1); }
+            blocks.push_back(current);
+            remaining = blockSize;
+            padding = (alignment - (size_t)current % alignment) % alignment;
+        }
+        void* memory = current + padding;
+        current += padding + size;
+        remaining -= padding + size;
+        bytes += size;
+        return memory;
+    }
+    
+public:
+    size_t allocations;     // objects constructed since the last Reset
+    size_t bytes;
+    
+    Arena() {
+        blockSize = 32 * 1024;
+        current = 0;
+        remaining = 0;
+        allocations = 0;
+        bytes = 0;
+    }
+    
+    ~Arena() {
+        Reset();
+    }
+    
+    template<typename T, typename... Args>
+    T* New(Args&&... args) {
+        T* object = new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        if (!std::is_trivially_destructible<T>::value) {
+            Destructor destructor = { object, [](void* p) { ((T*)p)->~T(); } };
+            destructors.push_back(destructor);
+        }
+        allocations++;
+        return object;
+    }
+    
+    void Reset() {
+        for (int i = (int)destructors.size() - 1; i >= 0; i--) destructors[i].destroy(destructors[i].object);
+        for (int i = 0; i < blocks.size(); i++) free(blocks[i]);
+        destructors.clear();
+        blocks.clear();
+        blockSize = 32 * 1024;
+        current = 0;
+        remaining = 0;
+        allocations = 0;
+        bytes = 0;
+    }
+    
+    int GetBlockCount() {
+        return (int)blocks.size();
+    }
+};
 
-// window has become invalid: redraw
-void onDisplay()
+// Typed free list on top of an arena: objects deleted while editing are reused by the next ones.
+template<typename T>
+class Pool
 {
-    glClearColor(0, 0, 0, 0); // background color
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // clear the screen
+    static_assert(std::is_trivially_destructible<T>::value, "the arena does not track pooled destructors");
     
-    gScene->Draw();
+    Arena& arena;
+    std::vector<T*> unused;
     
-    glutSwapBuffers(); // exchange the two buffers
-}
+public:
+    Pool(Arena& arena) : arena(arena) {}
+    
+    template<typename... Args>
+    T* New(Args&&... args) {
+        if (unused.empty()) return arena.New<T>(std::forward<Args>(args)...);
+        T* object = unused.back();
+        unused.pop_back();
+        return new (object) T(std::forward<Args>(args)...);
+    }
+    
+    void Delete(T* object) {
+        unused.push_back(object);
+    }
+    
+    // the arena was reset, the remembered memory is gone
+    void Clear() {
+        unused.clear();
+    }
+};
 
-vec2 mouseStartLocation;
-vec2 offset;
+// A generated piece of furniture. Layouts hold hundreds of thousands of them, so they live in one
+// flat array and are written straight to the instance buffer instead of becoming Objects.
+struct Placement
+{
+    Mesh* mesh;
+    vec2 position;
+    float transform[4];     // scaling and rotation, laid out like the upper left of a model matrix
+    float radius;
+    bool conflict = false;  // overlaps another item, set by the collision checks
+    
+    Placement(Mesh* mesh, vec2 position, float scale, float degrees) : mesh(mesh), position(position) {
+        float radians = degrees / 180 * M_PI;
+        transform[0] = scale * cosf(radians);
+        transform[1] = scale * sinf(radians);
+        transform[2] = -scale * sinf(radians);
+        transform[3] = scale * cosf(radians);
+        radius = scale;
+    }
+    
+    mat4 GetModelMatrix() {
+        return mat4(transform[0], transform[1], 0, 0,
+                    transform[2], transform[3], 0, 0,
+                    0, 0, 1, 0,
+                    position.x, position.y, 0, 1);
+    }
+};
 
-void onMouse(int button, int state, int x, int y) {
+// Uniform grid over a rectangle that answers whether a circle overlaps anything inserted so far.
+// Items are chained per cell in flat arrays; circles too large for a cell go to a short list that
+// every query checks.
+class SpatialGrid
+{
+    vec2 minimum;
+    float cellSize;
+    int columns, rows;
+    std::vector<int> heads;     // first item of every cell, -1 if empty
+    std::vector<int> next;      // next item in the same cell
+    std::vector<vec2> centers;
+    std::vector<float> radii;
+    std::vector<int> large;
     
-    std::vector<Object*> objects = gScene->GetObjects();
+    int Column(float x) {
+        return (int)fmin(fmax((x - minimum.x) / cellSize, 0), columns - 1);
+    }
     
-    if (state == GLUT_DOWN) {
-        // normalize
-        float cx = (float)x / (float)windowWidth;
-        float cy = (float)y / (float)windowHeight;
-        
-        // convert to coordinates
-        cx = (cx-0.5)/0.5;
-        cy = -(cy-0.5)/0.5;
-        
-        mouseStartLocation = vec2(cx, cy);
-        
-        float threshold = 0.3;
-        int index = -1;
-        
-        
-        for (int i = 0; i < objects.size(); i++) {
-            vec2 pos = objects[i]->GetPosition();
-            if (sqrt(pow((pos.x-cx), 2.0) + pow((pos.y-cy), 2.0)) <= threshold) index = i;
+    int Row(float y) {
+        return (int)fmin(fmax((y - minimum.y) / cellSize, 0), rows - 1);
+    }
+    
+    bool Hits(int item, vec2 p, float r) {
+        float dx = centers[item].x - p.x, dy = centers[item].y - p.y, d = radii[item] + r;
+        return dx * dx + dy * dy < d * d;
+    }
+    
+public:
+    // cellSize should be about the diameter of the typical item
+    void Reset(vec2 min, vec2 max, float size) {
+        size = fmax(size, fmax(max.x - min.x, max.y - min.y) / 1024);    // bounds the number of cells
+        minimum = min;
+        cellSize = size;
+        columns = (int)fmax(ceil((max.x - min.x) / size), 1);
+        rows = (int)fmax(ceil((max.y - min.y) / size), 1);
+        heads.assign(columns * rows, -1);
+        next.clear();
+        centers.clear();
+        radii.clear();
+        large.clear();
+    }
+    
+    void Insert(vec2 p, float r) {
+        int item = (int)centers.size();
+        centers.push_back(p);
+        radii.push_back(r);
+        if (r > cellSize * 0.5f) {
+            large.push_back(item);
+            next.push_back(-1);
+            return;
         }
-        
-        for (int i = 0; i < objects.size(); i++) objects[i]->SetSelected(false);
-        if (index != -1) objects[index]->SetSelected(true);
-        
-        printf("On coordinate %f, %f\n", cx, cy);
+        int cell = Row(p.y) * columns + Column(p.x);
+        next.push_back(heads[cell]);
+        heads[cell] = item;
     }
-    else if (state == GLUT_UP) {
-        for (int i = 0; i < objects.size(); i++) {
-            if (objects[i]->GetSelected()) {
-                objects[i]->SetPosition(offset);
+    
+    // Calls visit with the index of every inserted circle that overlaps the given one, in insertion
+    // order within a cell. Stops and returns true as soon as visit does. Read only, so any number
+    // of threads can query at once.
+    template<typename Visit>
+    bool Query(vec2 p, float r, Visit visit) {
+        for (int i = 0; i < large.size(); i++) if (Hits(large[i], p, r) && visit(large[i])) return true;
+        // cell items are at most half a cell in radius, so that much margin finds all candidates
+        float reach = r + cellSize * 0.5f;
+        int x0 = Column(p.x - reach), x1 = Column(p.x + reach);
+        int y0 = Row(p.y - reach), y1 = Row(p.y + reach);
+        for (int y = y0; y <= y1; y++) {
+            for (int x = x0; x <= x1; x++) {
+                for (int item = heads[y * columns + x]; item >= 0; item = next[item]) {
+                    if (Hits(item, p, r) && visit(item)) return true;
+                }
             }
         }
-        mouseStartLocation = vec2(0,0);
-        offset = vec2(0,0);
+        return false;
     }
-    glutPostRedisplay();
-}
-
-void onMouseDrag(int x, int y) {
     
-    float cx = (float)x / (float)windowWidth;
-    float cy = (float)y / (float)windowHeight;
+    // true if the circle comes closer than clearance to an inserted one
+    bool Overlaps(vec2 p, float r, float clearance) {
+        return Query(p, r + clearance, [](int) { return true; });
+    }
+};
+
+// An object or placement as the collision checks see it: its outline with the world transformation
+// and the bounding circle for the broad phase.
+struct Collider
+{
+    const std::vector<vec2>* outline;
+    float transform[4];
+    vec2 position;
+    float radius;
+    bool* conflict;
     
-    // convert to coordinates
-    cx = (cx-0.5)/0.5;
-    cy = -(cy-0.5)/0.5;
+    Collider(Object* object) {
+        mat4 M = object->GetWorldMatrix();
+        outline = &object->GetMesh()->GetGeometry()->GetOutline();
+        transform[0] = M.m[0][0];
+        transform[1] = M.m[0][1];
+        transform[2] = M.m[1][0];
+        transform[3] = M.m[1][1];
+        position = object->GetDrawPosition();
+        radius = object->GetBoundingRadius();
+        conflict = &object->conflict;
+    }
     
-    offset = vec2(cx-mouseStartLocation.x, cy-mouseStartLocation.y);
+    Collider(Placement& placement) {
+        outline = &placement.mesh->GetGeometry()->GetOutline();
+        for (int i = 0; i < 4; i++) transform[i] = placement.transform[i];
+        position = placement.position;
+        radius = placement.radius;
+        conflict = &placement.conflict;
+    }
     
-    std::vector<Object*> objects = gScene->GetObjects();
-    for (int i = 0; i < objects.size(); i++) {
-        if (objects[i]->GetSelected()) {
-            objects[i]->SetOffsetPosition(offset);
+    // the outline in world space and its bounding box
+    void GetWorldOutline(std::vector<vec2>& points, vec2& min, vec2& max) const {
+        points.resize(outline->size());
+        min = vec2(1e30f, 1e30f);
+        max = vec2(-1e30f, -1e30f);
+        for (int i = 0; i < outline->size(); i++) {
+            vec2 v = (*outline)[i];
+            vec2 p(v.x * transform[0] + v.y * transform[2] + position.x, v.x * transform[1] + v.y * transform[3] + position.y);
+            points[i] = p;
+            min = vec2(fmin(min.x, p.x), fmin(min.y, p.y));
+            max = vec2(fmax(max.x, p.x), fmax(max.y, p.y));
         }
     }
-    
-    // neeD some way to record last position in object
-    glutPostRedisplay();
+};
+
+float Cross(vec2 o, vec2 a, vec2 b) {
+    return (a.x - o.x) * (b.y - o.y) - (a.y - o.y) * (b.x - o.x);
 }
 
-void onKeyboardUp(unsigned char key, int i, int j) {
-    
-    std::vector<Material*> materials = gScene->GetMaterials();
-    std::vector<Geometry*> geometries = gScene->GetGeometries();
-    std::vector<Mesh*> meshes = gScene->GetMeshes();
-    std::vector<Object*> objects = gScene->GetObjects();
-    for (int i = 0; i < objects.size(); i++) {
-        if (keyboardState[127] && objects[i]->GetSelected()) {
-            materials.erase(materials.begin()+i);
-            geometries.erase(geometries.begin()+i);
-            meshes.erase(meshes.begin()+i);
-            objects.erase(objects.begin()+i);
-        }
-    }
-    gScene->SetMaterials(materials);
-    gScene->SetGeometries(geometries);
-    gScene->SetMeshes(meshes);
-    gScene->SetObjects(objects);
-    
-    keyboardState[key] = false;
-    glutPostRedisplay();
+// true if the segments ab and cd touch
+bool SegmentsCross(vec2 a, vec2 b, vec2 c, vec2 d) {
+    float d1 = Cross(c, d, a), d2 = Cross(c, d, b), d3 = Cross(a, b, c), d4 = Cross(a, b, d);
+    if (((d1 > 0 && d2 < 0) || (d1 < 0 && d2 > 0)) && ((d3 > 0 && d4 < 0) || (d3 < 0 && d4 > 0))) return true;
+    // collinear cases, rare enough to settle with the bounding boxes
+    auto onSegment = [](vec2 p, vec2 q, vec2 r) {
+        return fmin(p.x, q.x) <= r.x && r.x <= fmax(p.x, q.x) && fmin(p.y, q.y) <= r.y && r.y <= fmax(p.y, q.y);
+    };
+    return (d1 == 0 && onSegment(c, d, a)) || (d2 == 0 && onSegment(c, d, b)) ||
+           (d3 == 0 && onSegment(a, b, c)) || (d4 == 0 && onSegment(a, b, d));
 }
 
-void onKeyboard(unsigned char key, int i, int j) {
-    keyboardState[key] = true;
+// even-odd rule, so the self-touching rose outlines of coat racks work as well
+bool PolygonContains(const std::vector<vec2>& polygon, vec2 p) {
+    bool inside = false;
+    for (int i = 0, j = (int)polygon.size() - 1; i < polygon.size(); j = i++) {
+        vec2 a = polygon[i], b = polygon[j];
+        if ((a.y > p.y) != (b.y > p.y) && p.x < (b.x - a.x) * (p.y - a.y) / (b.y - a.y) + a.x) inside = !inside;
+    }
+    return inside;
 }
 
-void onIdle( ) {
-    // time elapsed since program started, in seconds
-    double t = glutGet(GLUT_ELAPSED_TIME) * 0.001;
-    // variable to remember last time idle was called
-    static double lastTime = 0.0;
-    // time difference between calls: time step
-    double dt = abs(t - lastTime);
-    // store time
-    lastTime = t;
-    camera.Move(dt);
+// Narrow phase on the actual outlines: two shapes overlap if their edges cross or one contains the
+// other. Only edges within the intersection of the bounding boxes are compared. Shapes without an
+// outline count as their bounding circle.
+bool OutlinesOverlap(const Collider& a, const Collider& b) {
+    float dx = a.position.x - b.position.x, dy = a.position.y - b.position.y, d = a.radius + b.radius;
+    if (dx * dx + dy * dy >= d * d) return false;
+    if (a.outline->empty() || b.outline->empty()) return true;
     
-    std::vector<Object*> objects = gScene->GetObjects();
-    for (int i = 0; i < objects.size(); i++) {
-        if (objects[i]->GetSelected() && keyboardState['a']) {
-            objects[i]->SetOrientation(dt);
+    static thread_local std::vector<vec2> pointsA, pointsB;
+    static thread_local std::vector<int> edgesA, edgesB;
+    vec2 minA, maxA, minB, maxB;
+    a.GetWorldOutline(pointsA, minA, maxA);
+    b.GetWorldOutline(pointsB, minB, maxB);
+    vec2 min(fmax(minA.x, minB.x), fmax(minA.y, minB.y)), max(fmin(maxA.x, maxB.x), fmin(maxA.y, maxB.y));
+    if (min.x > max.x || min.y > max.y) return false;
+    
+    auto collect = [&](const std::vector<vec2>& points, std::vector<int>& edges) {
+        edges.clear();
+        for (int i = 0; i < points.size(); i++) {
+            vec2 p = points[i], q = points[(i + 1) % points.size()];
+            if (fmax(p.x, q.x) >= min.x && fmin(p.x, q.x) <= max.x && fmax(p.y, q.y) >= min.y && fmin(p.y, q.y) <= max.y)
+                edges.push_back(i);
         }
-        if (objects[i]->GetSelected() && keyboardState['d']) {
-            objects[i]->SetOrientation(-dt);
+    };
+    collect(pointsA, edgesA);
+    collect(pointsB, edgesB);
+    for (int i = 0; i < edgesA.size(); i++) {
+        vec2 p = pointsA[edgesA[i]], q = pointsA[(edgesA[i] + 1) % pointsA.size()];
+        for (int j = 0; j < edgesB.size(); j++) {
+            if (SegmentsCross(p, q, pointsB[edgesB[j]], pointsB[(edgesB[j] + 1) % pointsB.size()])) return true;
         }
     }
-    
-    glutPostRedisplay();
+    return PolygonContains(pointsB, pointsA[0]) || PolygonContains(pointsA, pointsB[0]);
 }
 
-int main(int argc, char * argv[])
+enum LayoutKind
 {
-    glutInit(&argc, argv);
-#if !defined(__APPLE__)
-    glutInitContextVersion(majorVersion, minorVersion);
-#endif
-    glutInitWindowSize(windowWidth, windowHeight);     // application window is initially of resolution 512x512
-    glutInitWindowPosition(50, 50);            // relative location of the application window
-#if defined(__APPLE__)
-    glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH | GLUT_3_2_CORE_PROFILE);  // 8 bit R,G,B,A + double buffer + depth buffer
-#else
-    glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH);
-#endif
-    glutCreateWindow("Triangle Rendering");
+    LayoutRows,     // theater seating in rows with an aisle every twelve seats
+    LayoutGrid,     // classroom desks with a chair behind each
+    LayoutBanquet,  // round tables with chairs around them and plants in between
+};
+
+// the meshes the layouts are made of
+enum FurnitureKind
+{
+    FurnitureTable,
+    FurnitureChair,
+    FurniturePlant,
+    FurnitureKindCount
+};
+
+// Fills an area around a center with a regular arrangement of furniture. Every placement keeps
+// clearance to everything already in the grid, so generated blocks do not overlap each other or
+// the objects of the plan; rejected placements are skipped.
+class LayoutGenerator
+{
+    SpatialGrid grid;
+    std::vector<Placement>* out;
+    int remaining;
+    float clearance;
     
-#if !defined(__APPLE__)
-    glewExperimental = true;
-    glewInit();
-#endif
-    printf("GL Vendor    : %s\n", glGetString(GL_VENDOR));
+    // spacing and sizes of the three layouts, in world units
+    static constexpr float rowSeat = 0.04f, rowPitch = 0.1f, rowSpacing = 0.12f;
+    static constexpr float gridDesk = 0.06f, gridSeat = 0.035f, gridPitchX = 0.2f, gridPitchY = 0.22f, gridChair = 0.11f;
+    static constexpr int banquetChairs = 8;
+    static constexpr float banquetSize = 0.15f, banquetSeat = 0.0375f, banquetDistance = 1.35f * banquetSize,
+                           banquetPitch = 0.6f;
+    
+    // positions of a block of count placements: columns and rows, plus the aisles between the rows' seats
+    struct Arrangement
+    {
+        int columns, rows, aisles;
+    };
+    
+    static Arrangement Arrange(LayoutKind kind, int count) {
+        Arrangement a = { 1, 1, 0 };
+        if (kind == LayoutRows) {
+            a.columns = (int)fmax(ceil(sqrt((double)count) * 1.2), 1);
+            a.aisles = (a.columns - 1) / 12;
+            a.rows = (count + a.columns - 1) / a.columns;
+        }
+        else if (kind == LayoutGrid) {
+            a.columns = (int)fmax(ceil(sqrt(count * 0.5)), 1);
+            a.rows = (count / 2 + a.columns - 1) / a.columns + 1;
+        }
+        else {
+            a.columns = (int)fmax(ceil(sqrt(count / (banquetChairs + 2.0))), 1);
+            a.rows = (count / (banquetChairs + 2) + a.columns - 1) / a.columns + 1;
+        }
+        return a;
+    }
+    
+    bool Place(Mesh* mesh, vec2 p, float scale, float degrees) {
+        if (remaining <= 0 || grid.Overlaps(p, scale, clearance)) return false;
+        grid.Insert(p, scale);
+        out->push_back(Placement(mesh, p, scale, degrees));
+        remaining--;
+        return true;
+    }
+    
+public:
+    Mesh* table = 0;
+    Mesh* chair = 0;
+    Mesh* plant = 0;
+    
+    // Prepares a block of count placements around center and returns the area its furniture can
+    // reach, with the clearance around it. Obstacles touching that area have to be added after this
+    // and before Generate.
+    void Begin(LayoutKind kind, vec2 center, int count, float minimumClearance, vec2& min, vec2& max) {
+        clearance = minimumClearance;
+        Arrangement a = Arrange(kind, count);
+        vec2 half;
+        if (kind == LayoutRows) {
+            half = vec2((a.columns + a.aisles - 1) * rowPitch * 0.5f + rowSeat, (a.rows - 1) * rowSpacing * 0.5f + rowSeat);
+        }
+        else if (kind == LayoutGrid) {
+            // the chairs hang below the desks of the last row
+            half = vec2((a.columns - 1) * gridPitchX * 0.5f + gridDesk,
+                        (a.rows - 1) * gridPitchY * 0.5f + fmax(gridDesk, gridChair + gridSeat));
+        }
+        else {
+            float reach = banquetDistance + banquetSeat;
+            half = vec2((a.columns - 1) * banquetPitch * 0.5f + reach, (a.rows - 1) * banquetPitch * 0.5f + reach);
+        }
+        min = vec2(center.x - half.x - clearance, center.y - half.y - clearance);
+        max = vec2(center.x + half.x + clearance, center.y + half.y + clearance);
+        grid.Reset(min, max, 0.3f);
+    }
+    
+    void AddObstacle(vec2 p, float radius) {
+        grid.Insert(p, radius);
+    }
+    
+    // appends up to count placements to placements, returns how many were placed
+    int Generate(LayoutKind kind, vec2 center, int count, std::vector<Placement>& placements) {
+        out = &placements;
+        remaining = count;
+        placements.reserve(placements.size() + count);
+        
+        Arrangement a = Arrange(kind, count);
+        int columns = a.columns, rows = a.rows;
+        if (kind == LayoutRows) {
+            vec2 origin(center.x - (columns + a.aisles - 1) * rowPitch * 0.5f, center.y + (rows - 1) * rowSpacing * 0.5f);
+            for (int r = 0; r < rows && remaining > 0; r++) {
+                for (int s = 0; s < columns; s++) {
+                    Place(chair, vec2(origin.x + (s + s / 12) * rowPitch, origin.y - r * rowSpacing), rowSeat, 0);
+                }
+            }
+        }
+        else if (kind == LayoutGrid) {
+            vec2 origin(center.x - (columns - 1) * gridPitchX * 0.5f, center.y + (rows - 1) * gridPitchY * 0.5f);
+            for (int r = 0; r < rows && remaining > 0; r++) {
+                for (int c = 0; c < columns && remaining > 0; c++) {
+                    vec2 p(origin.x + c * gridPitchX, origin.y - r * gridPitchY);
+                    if (Place(table, p, gridDesk, 0)) Place(chair, vec2(p.x, p.y - gridChair), gridSeat, 0);
+                }
+            }
+        }
+        else {
+            // the same proportions as Scene::AddTableSetting
+            const int chairs = banquetChairs;
+            const float size = banquetSize, seat = banquetSeat, distance = banquetDistance, pitch = banquetPitch;
+            vec2 origin(center.x - (columns - 1) * pitch * 0.5f, center.y - (rows - 1) * pitch * 0.5f);
+            for (int r = 0; r < rows && remaining > 0; r++) {
+                for (int c = 0; c < columns && remaining > 0; c++) {
+                    vec2 p(origin.x + c * pitch, origin.y + r * pitch);
+                    if (!Place(table, p, size, 0)) continue;
+                    for (int i = 0; i < chairs; i++) {
+                        float angle = 2 * (float)M_PI * i / chairs;
+                        Place(chair, vec2(p.x + distance * cosf(angle), p.y + distance * sinf(angle)), seat, 0);
+                    }
+                    if (r + 1 < rows && c + 1 < columns) {
+                        Place(plant, vec2(p.x + pitch * 0.5f, p.y + pitch * 0.5f), 0.05f, (r * columns + c) * 37.0f);
+                    }
+                }
+            }
+        }
+        return count - remaining;
+    }
+};
+
+// Renders the scene on the CPU, for thumbnails on machines without a GPU driver. Items are binned
+// into square tiles by their bounding boxes and the tiles are filled in parallel, each in item
+// order, so later items cover earlier ones like in the instanced path. Triangles are scan converted
+// with half-space edge functions evaluated for four pixels at a time, and the covered span of every
+// row is colored by the material in one call.
+class SoftwareRenderer
+{
+    // an item to draw with the affine mappings between its model space and the pixels
+    struct Instance
+    {
+        Mesh* mesh;             // 0 if culled
+        float forward[6];       // model to pixel: x' = f0 x + f1 y + f2, y' = f3 x + f4 y + f5
+        float inverse[6];       // pixel to model, in the same layout
+        int x0, y0, x1, y1;     // pixel bounding box, exclusive at the end
+    };
+    
+    static const int tileSize = 64;
+    static const int chunkSize = 2048;
+    
+    int width, height, tilesX, tilesY;
+    std::vector<unsigned int> pixels;       // packed RGBA8, top row first
+    std::vector<Instance> instances;
+    std::vector<std::vector<int>> bins;     // instance indices per chunk and tile
+    
+    // Fills the pixels of the triangle inside the tile whose centers pass the top-left rule.
+    void DrawTriangle(Instance& instance, vec2 a, vec2 b, vec2 c, int tileX0, int tileY0, int tileX1, int tileY1,
+                      float time, unsigned int* span) {
+        float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+        if (area == 0) return;
+        if (area < 0) std::swap(b, c);      // all edge functions are positive inside
+        
+        int x0 = (int)fmax(tileX0, ceilf(fmin(a.x, fmin(b.x, c.x)) - 0.5f));
+        int x1 = (int)fmin(tileX1, floorf(fmax(a.x, fmax(b.x, c.x)) - 0.5f) + 1);
+        int y0 = (int)fmax(tileY0, ceilf(fmin(a.y, fmin(b.y, c.y)) - 0.5f));
+        int y1 = (int)fmin(tileY1, floorf(fmax(a.y, fmax(b.y, c.y)) - 0.5f) + 1);
+        if (x0 >= x1 || y0 >= y1) return;
+        
+        // E(p) = dx (p.y - from.y) - dy (p.x - from.x) for the edges ab, bc and ca
+        vec2 from[3] = { a, b, c }, to[3] = { b, c, a };
+        float4 stepX[3] = { 0, 0, 0 };
+        float dx[3], dy[3];
+        bool topLeft[3];
+        for (int k = 0; k < 3; k++) {
+            dx[k] = to[k].x - from[k].x;
+            dy[k] = to[k].y - from[k].y;
+            stepX[k] = float4(-4 * dy[k]);
+            // pixels exactly on a left or top edge belong to this triangle, on the others to the neighbour
+            topLeft[k] = dy[k] < 0 || (dy[k] == 0 && dx[k] > 0);
+        }
+        
+        Material* material = instance.mesh->GetMaterial();
+        const float* m = instance.inverse;
+        float4 zero(0.0f);
+        for (int y = y0; y < y1; y++) {
+            float cy = y + 0.5f;
+            float4 edges[3] = { 0, 0, 0 };
+            for (int k = 0; k < 3; k++) {
+                float start = dx[k] * (cy - from[k].y) - dy[k] * (x0 + 0.5f - from[k].x);
+                edges[k] = float4(start) - float4(0, 1, 2, 3) * float4(dy[k]);
+            }
+            // the triangle is convex, so the covered pixels of a row are contiguous
+            int first = -1, last = -1;
+            for (int x = x0; x < x1; x += 4) {
+                int mask = 15;
+                for (int k = 0; k < 3; k++) {
+                    mask &= topLeft[k] ? edges[k].GreaterEqual(zero) : edges[k].Greater(zero);
+                    edges[k] = edges[k] + stepX[k];
+                }
+                if (x + 4 > x1) mask &= (1 << (x1 - x)) - 1;
+                if (!mask) {
+                    if (first >= 0) break;
+                    continue;
+                }
+                for (int j = 0; j < 4; j++) {
+                    if (!(mask >> j & 1)) continue;
+                    if (first < 0) first = x + j;
+                    last = x + j;
+                }
+            }
+            if (first < 0) continue;
+            
+            int count = last - first + 1;
+            float px = first + 0.5f;
+            material->ShadeSpan(vec2(m[0] * px + m[1] * cy + m[2], m[3] * px + m[4] * cy + m[5]), vec2(m[0], m[3]),
+                                count, time, span);
+            memcpy(&pixels[y * width + first], span, count * sizeof(unsigned int));
+        }
+    }
+    
+    void DrawInstance(Instance& instance, int tileX0, int tileY0, int tileX1, int tileY1, float time,
+                      unsigned int* span) {
+        const std::vector<vec2>& triangles = instance.mesh->GetGeometry()->GetTriangles();
+        const float* f = instance.forward;
+        vec2 v[3];
+        for (int i = 0; i < triangles.size(); i += 3) {
+            for (int j = 0; j < 3; j++) {
+                vec2 p = triangles[i + j];
+                v[j] = vec2(f[0] * p.x + f[1] * p.y + f[2], f[3] * p.x + f[4] * p.y + f[5]);
+            }
+            DrawTriangle(instance, v[0], v[1], v[2], tileX0, tileY0, tileX1, tileY1, time, span);
+        }
+    }
+    
+public:
+    SoftwareRenderer(int width, int height) : width(width), height(height) {
+        tilesX = (width + tileSize - 1) / tileSize;
+        tilesY = (height + tileSize - 1) / tileSize;
+        pixels.resize(width * height);
+    }
+    
+    int GetWidth() {
+        return width;
+    }
+    
+    int GetHeight() {
+        return height;
+    }
+    
+    std::vector<unsigned int>& GetPixels() {
+        return pixels;
+    }
+    
+    // starts a frame of count items, which are then set or culled from any thread
+    void Begin(int count) {
+        instances.resize(count);
+    }
+    
+    void Cull(int i) {
+        instances[i].mesh = 0;
+    }
+    
+    // item i is mesh drawn with the model-view matrix M
+    void SetInstance(int i, Mesh* mesh, mat4 M) {
+        Instance& instance = instances[i];
+        instance.mesh = 0;
+        // normalized device coordinates to pixels, y pointing down
+        float sx = 0.5f * width, sy = -0.5f * height;
+        float* f = instance.forward;
+        f[0] = sx * M.m[0][0]; f[1] = sx * M.m[1][0]; f[2] = sx * (M.m[3][0] + 1);
+        f[3] = sy * M.m[0][1]; f[4] = sy * M.m[1][1]; f[5] = sy * (M.m[3][1] - 1);
+        float det = f[0] * f[4] - f[1] * f[3];
+        if (det == 0) return;
+        float* g = instance.inverse;
+        g[0] = f[4] / det; g[1] = -f[1] / det; g[2] = -(g[0] * f[2] + g[1] * f[5]);
+        g[3] = -f[3] / det; g[4] = f[0] / det; g[5] = -(g[3] * f[2] + g[4] * f[5]);
+        
+        // bounding box of the transformed model space bounding box
+        Geometry* geometry = mesh->GetGeometry();
+        vec2 lower = geometry->GetLower(), upper = geometry->GetUpper();
+        float minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f;
+        for (int j = 0; j < 4; j++) {
+            float x = j & 1 ? upper.x : lower.x, y = j & 2 ? upper.y : lower.y;
+            float px = f[0] * x + f[1] * y + f[2], py = f[3] * x + f[4] * y + f[5];
+            minX = fmin(minX, px); maxX = fmax(maxX, px);
+            minY = fmin(minY, py); maxY = fmax(maxY, py);
+        }
+        instance.x0 = (int)fmax(0, ceilf(minX - 0.5f));
+        instance.x1 = (int)fmin(width, floorf(maxX - 0.5f) + 1);
+        instance.y0 = (int)fmax(0, ceilf(minY - 0.5f));
+        instance.y1 = (int)fmin(height, floorf(maxY - 0.5f) + 1);
+        if (instance.x0 < instance.x1 && instance.y0 < instance.y1) instance.mesh = mesh;
+    }
+    
+    // bins the items in parallel chunks, then clears and fills the tiles on the job system
+    void Draw(float time) {
+        int count = (int)instances.size();
+        int chunks = (count + chunkSize - 1) / chunkSize;
+        int tileCount = tilesX * tilesY;
+        bins.resize(chunks * tileCount);
+        jobs.ParallelFor(count, chunkSize, [&](int begin, int end) {
+            std::vector<int>* chunkBins = &bins[begin / chunkSize * tileCount];
+            for (int t = 0; t < tileCount; t++) chunkBins[t].clear();
+            for (int i = begin; i < end; i++) {
+                Instance& instance = instances[i];
+                if (!instance.mesh) continue;
+                for (int ty = instance.y0 / tileSize; ty <= (instance.y1 - 1) / tileSize; ty++) {
+                    for (int tx = instance.x0 / tileSize; tx <= (instance.x1 - 1) / tileSize; tx++)
+                        chunkBins[ty * tilesX + tx].push_back(i);
+                }
+            }
+        });
+        
+        jobs.ParallelFor(tileCount, 1, [&](int begin, int end) {
+            unsigned int span[tileSize];
+            for (int t = begin; t < end; t++) {
+                int x0 = t % tilesX * tileSize, y0 = t / tilesX * tileSize;
+                int x1 = (int)fmin(x0 + tileSize, width), y1 = (int)fmin(y0 + tileSize, height);
+                for (int y = y0; y < y1; y++) std::fill(&pixels[y * width + x0], &pixels[y * width + x1], 0);
+                for (int c = 0; c < chunks; c++) {
+                    std::vector<int>& bin = bins[c * tileCount + t];
+                    for (int i = 0; i < bin.size(); i++) DrawInstance(instances[bin[i]], x0, y0, x1, y1, time, span);
+                }
+            }
+        });
+    }
+    
+    // binary PPM, readable by most image tools without any library
+    bool Save(const char* filename) {
+        FILE* file = fopen(filename, "wb");
+        if (!file) { printf("Cannot write %s\n", filename); return false; }
+        fprintf(file, "P6\n%d %d\n255\n", width, height);
+        std::vector<unsigned char> row(width * 3);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                unsigned int p = pixels[y * width + x];
+                row[x * 3] = p & 255;
+                row[x * 3 + 1] = p >> 8 & 255;
+                row[x * 3 + 2] = p >> 16 & 255;
+            }
+            fwrite(&row[0], 1, row.size(), file);
+        }
+        fclose(file);
+        return true;
+    }
+};
+
+class Scene {
+    Arena arena;            // materials, geometries, meshes and objects
+    Pool<Object> objectPool;
+    StandardShader* shader;
+    StripesShader* shader2;
+    HeartbeatShader* shader3;
+    std::vector<Material*> materials;
+    std::vector<Geometry*> geometries;
+    std::vector<Mesh*> meshes;
+    std::vector<Object*> objects;           // in draw order
+    std::vector<Object*> selection;         // the editable selected objects, moved by drags and rotations
+    
+    // objects sorted by their depth in the hierarchy, every level only depends on the previous one
+    std::vector<Object*> transformOrder;
+    std::vector<int> levelStarts;
+    bool hierarchyChanged = true;
+    
+    // The same objects depth first, every subtree is the range from its root to subtreeEnds. Objects
+    // moved since the last update are kept in dirtyRoots, so only their subtrees are recomputed.
+    std::vector<Object*> treeOrder;
+    std::vector<int> subtreeEnds;
+    std::vector<Object*> dirtyRoots;
+    
+    std::vector<Placement> placements;      // generated layouts, drawn below the objects
+    
+    // broad phase of the collision checks, grid items index colliders
+    SpatialGrid collisionGrid;
+    std::vector<Collider> colliders;
+    std::vector<Object*> movers;            // objects that follow the current drag
+    std::vector<int> flagged;               // colliders marked by the last drag check
+    
+    // A line an edge or the center of a dragged object can snap to. The alignment indexes hold the
+    // left, center and right x (top, center and bottom y) of every collider, sorted by value.
+    struct AlignmentLine
+    {
+        float value;
+        float other;    // center of the collider's box on the other axis, where the guide starts
+        
+        bool operator<(const AlignmentLine& line) const {
+            return value < line.value;
+        }
+    };
+    std::vector<AlignmentLine> alignX, alignY;
+    Object* dragAnchor = 0;                 // the picked object, its bounding box is what snaps
+    vec2 anchorStart;
+    vec2 anchorLow, anchorHigh;             // corners of its world space bounding box, relative to anchorStart
+    std::vector<vec2> guides;               // end points of the guide lines in world space
+    
+    // the edges and the center of the world space bounding box of every collider's outline
+    void BuildAlignmentIndex() {
+        alignX.resize(colliders.size() * 3);
+        alignY.resize(colliders.size() * 3);
+        jobs.ParallelFor((int)colliders.size(), 1024, [&](int begin, int end) {
+            std::vector<vec2> points;
+            for (int i = begin; i < end; i++) {
+                vec2 min, max;
+                colliders[i].GetWorldOutline(points, min, max);
+                float xs[3] = { min.x, (min.x + max.x) * 0.5f, max.x }, ys[3] = { min.y, (min.y + max.y) * 0.5f, max.y };
+                for (int j = 0; j < 3; j++) {
+                    AlignmentLine x = { xs[j], ys[1] }, y = { ys[j], xs[1] };
+                    alignX[i * 3 + j] = x;
+                    alignY[i * 3 + j] = y;
+                }
+            }
+        });
+        std::sort(alignX.begin(), alignX.end());
+        std::sort(alignY.begin(), alignY.end());
+    }
+    
+    // Finds the line closest to one of the edges or the center of the box from position + low to
+    // position + high, no further than tolerance. Among equally close lines the one nearest along
+    // the other axis wins, so the guide stays short. Only the lines within tolerance of the three
+    // values are visited.
+    bool Align(std::vector<AlignmentLine>& lines, float position, float other, float low, float high, float tolerance,
+               float& delta, AlignmentLine& match) {
+        bool found = false;
+        float targets[3] = { position + low, position + (low + high) * 0.5f, position + high };
+        for (int j = 0; j < 3; j++) {
+            float target = targets[j];
+            AlignmentLine low = { target - tolerance, 0 };
+            for (auto line = std::lower_bound(lines.begin(), lines.end(), low);
+                 line != lines.end() && line->value <= target + tolerance; ++line) {
+                float d = line->value - target;
+                if (!found || fabs(d) < fabs(delta) ||
+                    (fabs(d) == fabs(delta) && fabs(line->other - other) < fabs(match.other - other))) {
+                    delta = d;
+                    match = *line;
+                    found = true;
+                }
+            }
+        }
+        return found;
+    }
+    
+    // the collision state refers into the placement array, so changing it ends a drag check
+    void CancelDrag() {
+        movers.clear();
+        flagged.clear();
+        dragAnchor = 0;
+        guides.clear();
+    }
+    
+    void BuildCollisionGrid() {
+        vec2 min(1e30f, 1e30f), max(-1e30f, -1e30f);
+        for (int i = 0; i < colliders.size(); i++) {
+            min = vec2(fmin(min.x, colliders[i].position.x), fmin(min.y, colliders[i].position.y));
+            max = vec2(fmax(max.x, colliders[i].position.x), fmax(max.y, colliders[i].position.y));
+        }
+        collisionGrid.Reset(min, max, 0.3f);
+        for (int i = 0; i < colliders.size(); i++) collisionGrid.Insert(colliders[i].position, colliders[i].radius);
+    }
+    
+    Mesh* tableMesh = 0;
+    Mesh* chairMesh = 0;
+    Mesh* plantMesh = 0;
+    
+    void CreateFurnitureMeshes() {
+        if (tableMesh) return;
+        InitializeShaders();
+        materials.push_back(arena.New<StandardMaterial>(shader, vec4(0.6f, 0.4f, 0.2f)));
+        geometries.push_back(arena.New<RoundTable>(1,30));
+        tableMesh = arena.New<Mesh>(geometries.back(), materials.back());
+        meshes.push_back(tableMesh);
+        materials.push_back(arena.New<StandardMaterial>(shader, vec4(0.8f, 0.8f, 0.8f)));
+        geometries.push_back(arena.New<RoundTable>(1,12));
+        chairMesh = arena.New<Mesh>(geometries.back(), materials.back());
+        meshes.push_back(chairMesh);
+        materials.push_back(arena.New<StandardMaterial>(shader, vec4(0.1f, 0.6f, 0.2f)));
+        geometries.push_back(arena.New<Plant>());
+        plantMesh = arena.New<Mesh>(geometries.back(), materials.back());
+        meshes.push_back(plantMesh);
+    }
+    
+    void BuildTransformOrder() {
+        std::vector<int> depths(objects.size());
+        int levels = 0;
+        for (int i = 0; i < objects.size(); i++) {
+            int depth = 0;
+            for (Object* p = objects[i]->GetParent(); p; p = p->GetParent()) depth++;
+            depths[i] = depth;
+            if (depth + 1 > levels) levels = depth + 1;
+        }
+        // counting sort keeps the draw order within a level
+        levelStarts.assign(levels + 1, 0);
+        for (int i = 0; i < objects.size(); i++) levelStarts[depths[i] + 1]++;
+        for (int l = 0; l < levels; l++) levelStarts[l + 1] += levelStarts[l];
+        transformOrder.resize(objects.size());
+        std::vector<int> cursors(levelStarts.begin(), levelStarts.end() - 1);
+        for (int i = 0; i < objects.size(); i++) transformOrder[cursors[depths[i]]++] = objects[i];
+        
+        // children lists in draw order, then a depth first walk from every root
+        int n = (int)objects.size();
+        std::vector<int> firstChild(n, -1), nextSibling(n, -1);
+        for (int i = 0; i < n; i++) objects[i]->treeIndex = i;
+        for (int i = n - 1; i >= 0; i--) {
+            Object* parent = objects[i]->GetParent();
+            if (!parent) continue;
+            nextSibling[i] = firstChild[parent->treeIndex];
+            firstChild[parent->treeIndex] = i;
+        }
+        treeOrder.clear();
+        subtreeEnds.assign(n, 0);
+        std::vector<int> stack;
+        for (int root = 0; root < n; root++) {
+            if (objects[root]->GetParent()) continue;
+            stack.push_back(root);
+            while (!stack.empty()) {
+                int i = stack.back();
+                if (i < 0) {
+                    subtreeEnds[objects[~i]->treeIndex] = (int)treeOrder.size();      // subtree of ~i is done
+                    stack.pop_back();
+                    continue;
+                }
+                stack.back() = ~i;
+                objects[i]->treeIndex = (int)treeOrder.size();
+                treeOrder.push_back(objects[i]);
+                std::vector<int>::size_type top = stack.size();
+                for (int c = firstChild[i]; c >= 0; c = nextSibling[c]) stack.push_back(c);
+                std::reverse(stack.begin() + top, stack.end());
+            }
+        }
+        hierarchyChanged = false;
+    }
+    
+public:
+    Scene() : objectPool(arena) {
+        shader = 0;
+        shader2 = 0;
+        shader3 = 0;
+    }
+    void InitializeShaders() {
+        if (shader || softwareOnly) return;
+        double start = profiler.Now();
+        // all compilations are issued before the first status query, so they run concurrently
+        shader = new StandardShader();
+        shader2 = new StripesShader();
+        shader3 = new HeartbeatShader();
+        shader->Finish();
+        shader2->Finish();
+        shader3->Finish();
+        printf("Shaders ready in %.1f ms (%d programs from cache, %d compiled%s)\n", (profiler.Now() - start) * 1000,
+               shaderCache.loaded, shaderCache.compiled, parallelShaderCompile ? " in parallel" : "");
+    }
+    
+    void Initialize() {
+        
+        InitializeShaders();
+        
+        materials.push_back(arena.New<StandardMaterial>(shader, vec4(1, 0, 0)));
+        materials.push_back(arena.New<StandardMaterial>(shader, vec4(0, 1, 0)));
+        materials.push_back(arena.New<StandardMaterial>(shader, vec4(0, 0, 1)));
+        
+        geometries.push_back(arena.New<RoundTable>(1,30));
+        geometries.push_back(arena.New<Plant>());
+        geometries.push_back(arena.New<CoatRack>(4,80));
+        
+        meshes.push_back(arena.New<Mesh>(geometries[0], materials[0]));
+        meshes.push_back(arena.New<Mesh>(geometries[1], materials[1]));
+        meshes.push_back(arena.New<Mesh>(geometries[2], materials[2]));
+        
+        objects.push_back(objectPool.New(shader, meshes[0], vec2(-0.5, -0.5), vec2(0.5, 0.5), 10.0));
+        objects.push_back(objectPool.New(shader, meshes[1], vec2(0.25, 0.5), vec2(0.5, 0.5), -30.0));
+        objects.push_back(objectPool.New(shader, meshes[2], vec2(0, 0), vec2(0.5, 0.5), 0));
+        
+        materials.push_back(arena.New<WideRedStripes>(shader2, vec4(1.0, 1.0, 0.5)));
+        geometries.push_back(arena.New<RoundTable>(1,30));
+        meshes.push_back(arena.New<Mesh>(geometries[3], materials[3]));
+        objects.push_back(objectPool.New(shader2, meshes[3], vec2(0.5, -0.5), vec2(0.3, 0.3), 0));
+        
+        materials.push_back(arena.New<NarrowCyanStripes>(shader2, vec4(1.0, 0.5, 0)));
+        geometries.push_back(arena.New<Plant>());
+        meshes.push_back(arena.New<Mesh>(geometries[4], materials[4]));
+        objects.push_back(objectPool.New(shader2, meshes[4], vec2(0.9, 0), vec2(0.3, 0.3), 0));
+        
+        materials.push_back(arena.New<HeartbeatMaterial>(shader3, vec4(0.5, 0, 0)));
+        geometries.push_back(arena.New<CoatRack>(3,60));
+        meshes.push_back(arena.New<Mesh>(geometries[5], materials[5]));
+        objects.push_back(objectPool.New(shader3, meshes[5], vec2(-0.7, 0.7), vec2(0.8, 0.8), 0));
+        
+    }
+    
+    // Makes child move, rotate and scale with parent. The local position, scaling and orientation of
+    // the child are interpreted relative to the parent from now on.
+    void Attach(Object* child, Object* parent) {
+        child->SetParent(parent);
+        dirtyRoots.push_back(child);
+        hierarchyChanged = true;
+    }
+    
+    // A round table with chairs evenly spaced around it, grouped so the set moves as one piece.
+    // Returns the table.
+    Object* AddTableSetting(vec2 center, int chairs) {
+        CreateFurnitureMeshes();
+        Object* table = objectPool.New(shader, tableMesh, center, vec2(0.15f, 0.15f), 0);
+        objects.push_back(table);
+        for (int i = 0; i < chairs; i++) {
+            float angle = 2 * (float)M_PI * i / chairs;
+            Object* chair = objectPool.New(shader, chairMesh, vec2(1.35f * cosf(angle), 1.35f * sinf(angle)),
+                                           vec2(0.25f, 0.25f), 0);
+            objects.push_back(chair);
+            Attach(chair, table);
+        }
+        hierarchyChanged = true;
+        return table;
+    }
+    
+    // Generates a layout of up to count placements around center into out, keeping clear of the
+    // objects and the layouts already in the scene. Returns the number of placements.
+    int GenerateLayout(LayoutKind kind, vec2 center, int count, std::vector<Placement>& out) {
+        CreateFurnitureMeshes();
+        UpdateTransforms();
+        LayoutGenerator generator;
+        generator.table = tableMesh;
+        generator.chair = chairMesh;
+        generator.plant = plantMesh;
+        vec2 min, max;
+        generator.Begin(kind, center, count, 0.01f, min, max);
+        
+        // only what can touch the block matters
+        auto inside = [&](vec2 p, float r) {
+            return p.x + r >= min.x && p.x - r <= max.x && p.y + r >= min.y && p.y - r <= max.y;
+        };
+        for (int i = 0; i < objects.size(); i++) {
+            vec2 p = objects[i]->GetDrawPosition();
+            float r = objects[i]->GetBoundingRadius();
+            if (inside(p, r)) generator.AddObstacle(p, r);
+        }
+        for (int i = 0; i < placements.size(); i++) {
+            if (inside(placements[i].position, placements[i].radius))
+                generator.AddObstacle(placements[i].position, placements[i].radius);
+        }
+        return generator.Generate(kind, center, count, out);
+    }
+    
+    int AddLayout(LayoutKind kind, vec2 center, int count) {
+        CancelDrag();
+        return GenerateLayout(kind, center, count, placements);
+    }
+    
+    void ClearLayouts() {
+        CancelDrag();
+        placements.clear();
+    }
+    
+    std::vector<Placement>& GetPlacements() {
+        return placements;
+    }
+    
+    Mesh* GetFurnitureMesh(FurnitureKind kind) {
+        CreateFurnitureMeshes();
+        return kind == FurnitureTable ? tableMesh : kind == FurnitureChair ? chairMesh : plantMesh;
+    }
+    
+    // bounding box of all objects and placements, false if the plan is empty
+    bool GetBounds(vec2& min, vec2& max) {
+        UpdateTransforms();
+        min = vec2(1e30f, 1e30f);
+        max = vec2(-1e30f, -1e30f);
+        auto add = [&](vec2 p, float radius) {
+            min = vec2(fmin(min.x, p.x - radius), fmin(min.y, p.y - radius));
+            max = vec2(fmax(max.x, p.x + radius), fmax(max.y, p.y + radius));
+        };
+        for (int i = 0; i < objects.size(); i++) add(objects[i]->GetDrawPosition(), objects[i]->GetBoundingRadius());
+        for (int i = 0; i < placements.size(); i++) add(placements[i].position, placements[i].radius);
+        return min.x <= max.x;
+    }
+    
+    void ClearConflicts() {
+        for (int i = 0; i < objects.size(); i++) objects[i]->conflict = false;
+        for (int i = 0; i < placements.size(); i++) placements[i].conflict = false;
+    }
+    
+    // Call when a drag starts. Everything that stays in place goes into the broad phase grid once,
+    // so every drag event only queries around the moving objects.
+    void BeginDrag() {
+        UpdateTransforms();
+        ClearConflicts();
+        movers.clear();
+        colliders.clear();
+        flagged.clear();
+        for (int i = 0; i < objects.size(); i++) {
+            bool moving = false;
+            for (Object* o = objects[i]; o && !moving; o = o->GetParent()) moving = o->GetSelected();
+            if (moving) movers.push_back(objects[i]);
+            else colliders.push_back(Collider(objects[i]));
+        }
+        if (movers.empty()) return;
+        for (int i = 0; i < placements.size(); i++) colliders.push_back(Collider(placements[i]));
+        BuildCollisionGrid();
+        
+        for (int i = 0; i < movers.size() && !dragAnchor; i++) {
+            if (movers[i]->IsEditable()) dragAnchor = movers[i];
+        }
+        if (!dragAnchor) return;
+        anchorStart = dragAnchor->GetDrawPosition();
+        std::vector<vec2> points;
+        Collider(dragAnchor).GetWorldOutline(points, anchorLow, anchorHigh);
+        anchorLow = vec2(anchorLow.x - anchorStart.x, anchorLow.y - anchorStart.y);
+        anchorHigh = vec2(anchorHigh.x - anchorStart.x, anchorHigh.y - anchorStart.y);
+        BuildAlignmentIndex();
+    }
+    
+    // Adjusts a drag offset so the dragged object lines up with the edges or centers of nearby
+    // furniture within tolerance, or else with a grid of the given size (0 disables the grid).
+    // The guide lines to the objects it aligned with are kept for drawing.
+    vec2 SnapDrag(vec2 offset, float tolerance, float grid) {
+        guides.clear();
+        if (!dragAnchor) return offset;
+        vec2 p(anchorStart.x + offset.x, anchorStart.y + offset.y);
+        float dx = 0, dy = 0;
+        AlignmentLine lineX = { 0, 0 }, lineY = { 0, 0 };
+        bool alignedX = Align(alignX, p.x, p.y, anchorLow.x, anchorHigh.x, tolerance, dx, lineX);
+        bool alignedY = Align(alignY, p.y, p.x, anchorLow.y, anchorHigh.y, tolerance, dy, lineY);
+        if (!alignedX && grid > 0) dx = roundf(p.x / grid) * grid - p.x;
+        if (!alignedY && grid > 0) dy = roundf(p.y / grid) * grid - p.y;
+        p = vec2(p.x + dx, p.y + dy);
+        vec2 center(p.x + (anchorLow.x + anchorHigh.x) * 0.5f, p.y + (anchorLow.y + anchorHigh.y) * 0.5f);
+        if (alignedX) {
+            guides.push_back(vec2(lineX.value, lineX.other));
+            guides.push_back(vec2(lineX.value, center.y));
+        }
+        if (alignedY) {
+            guides.push_back(vec2(lineY.other, lineY.value));
+            guides.push_back(vec2(center.x, lineY.value));
+        }
+        return vec2(offset.x + dx, offset.y + dy);
+    }
+    
+    std::vector<vec2>& GetGuides() {
+        return guides;
+    }
+    
+    // Tests the moving objects against the rest and marks both sides of every overlap. Returns the
+    // number of moving objects that overlap something.
+    int CheckDrag() {
+        UpdateTransforms();
+        for (int i = 0; i < flagged.size(); i++) *colliders[flagged[i]].conflict = false;
+        flagged.clear();
+        int conflicts = 0;
+        for (int i = 0; i < movers.size(); i++) {
+            Collider mover(movers[i]);
+            bool hit = false;
+            collisionGrid.Query(mover.position, mover.radius, [&](int item) {
+                if (OutlinesOverlap(mover, colliders[item])) {
+                    hit = true;
+                    *colliders[item].conflict = true;
+                    flagged.push_back(item);
+                }
+                return false;
+            });
+            movers[i]->conflict = hit;
+            if (hit) conflicts++;
+        }
+        return conflicts;
+    }
+    
+    void EndDrag() {
+        if (movers.empty()) return;
+        ClearConflicts();
+        CancelDrag();
+    }
+    
+    // Checks every object and placement against all others in parallel and marks the overlapping
+    // ones. Every item only writes its own flag, so pairs are tested from both sides. Returns the
+    // number of overlapping items.
+    int ValidateLayout() {
+        CancelDrag();
+        UpdateTransforms();
+        colliders.clear();
+        for (int i = 0; i < objects.size(); i++) colliders.push_back(Collider(objects[i]));
+        for (int i = 0; i < placements.size(); i++) colliders.push_back(Collider(placements[i]));
+        BuildCollisionGrid();
+        
+        std::atomic<int> conflicts(0);
+        jobs.ParallelFor((int)colliders.size(), 1024, [&](int begin, int end) {
+            int found = 0;
+            for (int i = begin; i < end; i++) {
+                Collider& collider = colliders[i];
+                bool hit = collisionGrid.Query(collider.position, collider.radius, [&](int item) {
+                    return item != i && OutlinesOverlap(collider, colliders[item]);
+                });
+                *collider.conflict = hit;
+                if (hit) found++;
+            }
+            conflicts += found;
+        });
+        return conflicts;
+    }
+    
+    // Brings the world matrices up to date, one hierarchy level at a time with the levels split
+    // across the job system. Only moved objects and their descendants are recomputed.
+    void UpdateTransforms() {
+        if (!hierarchyChanged && dirtyRoots.empty()) return;
+        if (hierarchyChanged) BuildTransformOrder();
+        else if (dirtyRoots.size() * 8 < treeOrder.size()) {
+            // a few moved groups: walk their subtrees, parents come before their children
+            for (int r = 0; r < dirtyRoots.size(); r++) {
+                int begin = dirtyRoots[r]->treeIndex, end = subtreeEnds[begin];
+                for (int i = begin; i < end; i++) treeOrder[i]->UpdateWorld();
+            }
+            dirtyRoots.clear();
+            return;
+        }
+        // new objects or many moved ones: level by level in parallel, skipping the unchanged subtrees
+        for (int l = 0; l + 1 < levelStarts.size(); l++) {
+            int begin = levelStarts[l];
+            jobs.ParallelFor(levelStarts[l + 1] - begin, 4096, [&](int first, int last) {
+                for (int i = begin + first; i < begin + last; i++) transformOrder[i]->UpdateWorld();
+            });
+        }
+        dirtyRoots.clear();
+    }
+    
+    // Procedurally fills the scene with n objects on a jittered grid, mixing all geometries with
+    // all four material types. The same seed always produces the same venue.
+    void GenerateVenue(int n, unsigned int seed) {
+        InitializeShaders();
+        std::mt19937 rng(seed);
+        // raw mt19937 output is identical on every platform, unlike std::uniform_real_distribution
+        auto random = [&rng]() { return (rng() >> 8) * (1.0f / 16777216.0f); };
+        
+        int firstGeometry = (int)geometries.size();
+        geometries.push_back(arena.New<RoundTable>(1,30));
+        geometries.push_back(arena.New<Plant>());
+        geometries.push_back(arena.New<CoatRack>(4,80));
+        
+        int firstMaterial = (int)materials.size();
+        materials.push_back(arena.New<StandardMaterial>(shader, vec4(1, 0, 0)));
+        materials.push_back(arena.New<WideRedStripes>(shader2, vec4(1.0, 1.0, 0.5)));
+        materials.push_back(arena.New<NarrowCyanStripes>(shader2, vec4(1.0, 0.5, 0)));
+        materials.push_back(arena.New<HeartbeatMaterial>(shader3, vec4(0.5, 0, 0)));
+        Shader* materialShaders[4] = { shader, shader2, shader2, shader3 };
+        
+        int firstMesh = (int)meshes.size();
+        for (int g = 0; g < 3; g++) {
+            for (int m = 0; m < 4; m++) {
+                meshes.push_back(arena.New<Mesh>(geometries[firstGeometry + g], materials[firstMaterial + m]));
+            }
+        }
+        
+        int columns = (int)ceil(sqrt((double)n));
+        float spacing = 0.25f;
+        float extent = columns * spacing * 0.5f;
+        for (int i = 0; i < n; i++) {
+            int meshIndex = (int)(rng() % 12);
+            vec2 position(-extent + (i % columns + 0.5f + (random() - 0.5f) * 0.3f) * spacing,
+                          -extent + (i / columns + 0.5f + (random() - 0.5f) * 0.3f) * spacing);
+            float size = 0.06f + random() * 0.04f;
+            objects.push_back(objectPool.New(materialShaders[meshIndex % 4], meshes[firstMesh + meshIndex],
+                                         position, vec2(size, size), random() * 360.0f));
+        }
+        hierarchyChanged = true;
+    }
+    
+    // index of the object closest to p within the pick radius, -1 if there is none
+    int Pick(vec2 p, float threshold) {
+        UpdateTransforms();
+        int index = -1;
+        float best = threshold * threshold;
+        for (int i = 0; i < objects.size(); i++) {
+            vec2 pos = objects[i]->GetDrawPosition();
+            float d = (pos.x - p.x) * (pos.x - p.x) + (pos.y - p.y) * (pos.y - p.y);
+            if (d <= best) {
+                best = d;
+                index = i;
+            }
+        }
+        return index;
+    }
+    
+    // Selects the whole group the object belongs to and deselects all others, or only the object
+    // itself if single is set. -1 clears the selection.
+    void Select(int index, bool single = false) {
+        Object* root = index < 0 ? 0 : single ? objects[index] : objects[index]->GetRoot();
+        for (int i = 0; i < objects.size(); i++) {
+            Object* object = objects[i];
+            bool inGroup = false;
+            for (Object* o = object; o && root && !inGroup; o = single ? 0 : o->GetParent()) inGroup = o == root;
+            object->SetSelected(inGroup);
+        }
+        selection.clear();
+        for (int i = 0; i < objects.size(); i++) {
+            if (objects[i]->IsEditable()) selection.push_back(objects[i]);
+        }
+    }
+    
+    std::vector<Object*>& GetSelection() {
+        return selection;
+    }
+    
+    // offset is the drag translation in world space since the drag started
+    void MoveSelection(vec2 offset) {
+        for (int i = 0; i < selection.size(); i++) selection[i]->SetOffsetPosition(offset);
+        dirtyRoots.insert(dirtyRoots.end(), selection.begin(), selection.end());
+    }
+    
+    // makes the drag translation permanent
+    void DropSelection(vec2 offset) {
+        for (int i = 0; i < selection.size(); i++) selection[i]->SetPosition(offset);
+        dirtyRoots.insert(dirtyRoots.end(), selection.begin(), selection.end());
+    }
+    
+    // turns the selection by angle times the rotation speed
+    void RotateSelection(double angle) {
+        jobs.ParallelFor((int)selection.size(), 4096, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) selection[i]->SetOrientation(angle);
+        });
+        dirtyRoots.insert(dirtyRoots.end(), selection.begin(), selection.end());
+    }
+    
+    Arena& GetArena() {
+        return arena;
+    }
+    
+    // Removes the selected objects together with everything attached to them. Their meshes stay
+    // owned by the scene since they can be shared.
+    void DeleteSelected() {
+        // a drag in progress keeps pointers to the moving objects and their conflict flags
+        EndDrag();
+        colliders.clear();
+        UpdateTransforms();     // parents come before their children in the transform order
+        for (int i = 0; i < transformOrder.size(); i++) {
+            Object* object = transformOrder[i];
+            object->deleted = object->GetSelected() || (object->GetParent() && object->GetParent()->deleted);
+        }
+        std::vector<Object*> kept;
+        for (int i = 0; i < objects.size(); i++) {
+            if (!objects[i]->deleted) kept.push_back(objects[i]);
+        }
+        for (int i = 0; i < objects.size(); i++) {
+            if (objects[i]->deleted) objectPool.Delete(objects[i]);
+        }
+        objects = kept;
+        selection.clear();
+        hierarchyChanged = true;
+    }
+    
+    std::vector<Material*> GetMaterials() {
+        return materials;
+    }
+    
+    void SetMaterials(std::vector<Material*> m) {
+        materials = m;
+    }
+    
+    std::vector<Geometry*> GetGeometries() {
+        return geometries;
+    }
+    
+    void SetGeometries(std::vector<Geometry*> g) {
+        geometries = g;
+    }
+    
+    std::vector<Mesh*> GetMeshes() {
+        return meshes;
+    }
+    
+    void SetMeshes(std::vector<Mesh*> m) {
+        meshes = m;
+    }
+    
+    std::vector<Object*> GetObjects() {
+        return objects;
+    }
+    
+    void SetObjects(std::vector<Object*> o) {
+        objects = o;
+        selection.clear();
+        hierarchyChanged = true;
+    }
+    
+    ~Scene() {
+        // materials, geometries, meshes and objects go away with their arena, geometries free their vertex arrays and buffers
+        objectPool.Clear();
+        arena.Reset();
+        if(shader) delete shader;
+        if(shader2) delete shader2;
+        if(shader3) delete shader3;
+    }
+    
+    // true if an object with an animated material is on screen, which forces continuous redraws
+    bool HasVisibleAnimation(Camera& camera) {
+        UpdateTransforms();
+        for(int i = 0; i < objects.size(); i++) {
+            if (objects[i]->GetMesh()->GetMaterial()->IsAnimated() &&
+                camera.IsVisible(objects[i]->GetDrawPosition(), objects[i]->GetBoundingRadius()))
+                return true;
+        }
+        return false;
+    }
+    
+    // culling and transformations of all objects in parallel chunks, in the original object order
+    void BuildCommandList(CommandList& list) {
+        const int chunkSize = 2048;
+        int count = (int)objects.size();
+        list.Resize((count + chunkSize - 1) / chunkSize);
+        mat4 V = camera.GetViewTransformationMatrix();
+        
+        jobs.ParallelFor(count, chunkSize, [&](int begin, int end) {
+            std::vector<DrawCommand>& commands = list.GetChunk(begin / chunkSize);
+            commands.clear();
+            for (int i = begin; i < end; i++) {
+                Object* object = objects[i];
+                if (!camera.IsVisible(object->GetDrawPosition(), object->GetBoundingRadius())) continue;
+                DrawCommand command;
+                command.shader = object->GetShader();
+                command.mesh = object->GetMesh();
+                command.M = object->GetWorldMatrix() * V;
+                commands.push_back(command);
+            }
+        });
+    }
+    
+    // Collects the instance data of the visible selected and overlapping items per mesh index, with
+    // the selection in the red and overlaps in the green channel of the color. Returns the number
+    // of instances. Every object and placement is still checked for its flags each frame, but only the
+    // highlighted ones are culled, uploaded and drawn, and the main draw is not touched.
+    int CollectHighlights(std::vector<std::vector<InstanceData>>& batches) {
+        int meshCount = (int)meshes.size();
+        for (int m = 0; m < meshCount; m++) meshes[m]->SetIndex(m);
+        batches.resize(meshCount);
+        for (int m = 0; m < meshCount; m++) batches[m].clear();
+        mat4 V = camera.GetViewTransformationMatrix();
+        int total = 0;
+        auto add = [&](Mesh* mesh, mat4 M, bool selected, bool conflict) {
+            InstanceData instance = { { M.m[0][0], M.m[0][1], M.m[1][0], M.m[1][1] },
+                                      { M.m[3][0], M.m[3][1], 0, 1 },
+                                      { selected ? 1.0f : 0.0f, conflict ? 1.0f : 0.0f, 0, 1 } };
+            batches[mesh->GetIndex()].push_back(instance);
+            total++;
+        };
+        for (int i = 0; i < objects.size(); i++) {
+            Object* object = objects[i];
+            if (!object->GetSelected() && !object->conflict) continue;
+            if (!camera.IsVisible(object->GetDrawPosition(), object->GetBoundingRadius())) continue;
+            add(object->GetMesh(), object->GetWorldMatrix() * V, object->GetSelected(), object->conflict);
+        }
+        for (int i = 0; i < placements.size(); i++) {
+            if (!placements[i].conflict || !camera.IsVisible(placements[i].position, placements[i].radius)) continue;
+            add(placements[i].mesh, placements[i].GetModelMatrix() * V, false, true);
+        }
+        return total;
+    }
+    
+    // Culls and writes the instance data of all placements and objects straight into the stream
+    // buffer on the job system, then draws one instanced call per mesh. Painter's order is kept by
+    // giving later items a smaller depth, so batching may reorder the draw calls. Items are numbered
+    // placements first, so generated layouts stay below the objects.
+    void DrawInstanced(InstanceBatches& batches) {
+        const int chunkSize = 2048;
+        int placementCount = (int)placements.size();
+        int count = placementCount + (int)objects.size();
+        int chunks = (count + chunkSize - 1) / chunkSize;
+        int meshCount = (int)meshes.size();
+        for (int m = 0; m < meshCount; m++) meshes[m]->SetIndex(m);
+        batches.Resize(chunks, meshCount);
+        mat4 V = camera.GetViewTransformationMatrix();
+        
+        profiler.Begin(SectionCull);
+        jobs.ParallelFor(count, chunkSize, [&](int begin, int end) {
+            int chunk = begin / chunkSize;
+            std::vector<int>& visible = batches.visible[chunk];
+            int* counts = &batches.counts[chunk * meshCount];
+            visible.clear();
+            for (int i = begin; i < end; i++) {
+                if (i < placementCount) {
+                    Placement& placement = placements[i];
+                    if (!camera.IsVisible(placement.position, placement.radius)) continue;
+                    visible.push_back(i);
+                    counts[placement.mesh->GetIndex()]++;
+                    continue;
+                }
+                Object* object = objects[i - placementCount];
+                if (!camera.IsVisible(object->GetDrawPosition(), object->GetBoundingRadius())) continue;
+                visible.push_back(i);
+                counts[object->GetMesh()->GetIndex()]++;
+            }
+        });
+        
+        // instances are grouped by mesh, within a mesh by chunk
+        int total = 0;
+        for (int m = 0; m < meshCount; m++) {
+            batches.batchOffsets[m] = total;
+            for (int c = 0; c < chunks; c++) {
+                int n = batches.counts[c * meshCount + m];
+                batches.counts[c * meshCount + m] = total;
+                total += n;
+            }
+            batches.batchCounts[m] = total - batches.batchOffsets[m];
+        }
+        
+        InstanceData* data = (InstanceData*)batches.stream.Begin(fmax(total, 1) * sizeof(InstanceData));
+        jobs.ParallelFor(count, chunkSize, [&](int begin, int end) {
+            int chunk = begin / chunkSize;
+            std::vector<int>& visible = batches.visible[chunk];
+            int* cursors = &batches.counts[chunk * meshCount];
+            for (int v = 0; v < visible.size(); v++) {
+                int i = visible[v];
+                Mesh* mesh;
+                mat4 M;
+                if (i < placementCount) {
+                    mesh = placements[i].mesh;
+                    M = placements[i].GetModelMatrix() * V;
+                }
+                else {
+                    Object* object = objects[i - placementCount];
+                    mesh = object->GetMesh();
+                    M = object->GetWorldMatrix() * V;
+                }
+                vec4 color = mesh->GetMaterial()->GetColor();
+                InstanceData& instance = data[cursors[mesh->GetIndex()]++];
+                instance.transform[0] = M.m[0][0];
+                instance.transform[1] = M.m[0][1];
+                instance.transform[2] = M.m[1][0];
+                instance.transform[3] = M.m[1][1];
+                instance.translation[0] = M.m[3][0];
+                instance.translation[1] = M.m[3][1];
+                instance.translation[2] = 1 - 2.0f * (i + 1) / (count + 1);
+                instance.translation[3] = 1;
+                instance.color[0] = color.v[0];
+                instance.color[1] = color.v[1];
+                instance.color[2] = color.v[2];
+                instance.color[3] = 1;
+            }
+        });
+        batches.stream.End();
+        profiler.End(SectionCull);
+        
+        profiler.Begin(SectionDraw);
+        glEnable(GL_DEPTH_TEST);
+        if (analyticCoverage) {
+            // edges blend with what was drawn before, approximate where batches overlap
+            glEnable(GL_BLEND);
+            glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        }
+        Shader* current = 0;
+        for (int m = 0; m < meshCount; m++) {
+            if (!batches.batchCounts[m]) continue;
+            Material* material = meshes[m]->GetMaterial();
+            if (material->GetShader() != current) {
+                current = material->GetShader();
+                current->RunInstanced();
+            }
+            material->UploadAttributes();
+            meshes[m]->GetGeometry()->DrawInstanced(batches.stream.GetBuffer(),
+                batches.stream.GetOffset() + batches.batchOffsets[m] * sizeof(InstanceData), batches.batchCounts[m]);
+        }
+        glDisable(GL_DEPTH_TEST);
+        glDisable(GL_BLEND);
+        batches.stream.Fence();
+        profiler.End(SectionDraw);
+    }
+    
+    // DrawInstanced for the software rasterizer, with the same culling and draw order
+    void DrawSoftware(SoftwareRenderer& renderer, float time) {
+        int placementCount = (int)placements.size();
+        int count = placementCount + (int)objects.size();
+        mat4 V = camera.GetViewTransformationMatrix();
+        
+        profiler.Begin(SectionCull);
+        renderer.Begin(count);
+        jobs.ParallelFor(count, 2048, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                if (i < placementCount) {
+                    Placement& placement = placements[i];
+                    if (camera.IsVisible(placement.position, placement.radius))
+                        renderer.SetInstance(i, placement.mesh, placement.GetModelMatrix() * V);
+                    else renderer.Cull(i);
+                    continue;
+                }
+                Object* object = objects[i - placementCount];
+                if (camera.IsVisible(object->GetDrawPosition(), object->GetBoundingRadius()))
+                    renderer.SetInstance(i, object->GetMesh(), object->GetWorldMatrix() * V);
+                else renderer.Cull(i);
+            }
+        });
+        profiler.End(SectionCull);
+        
+        profiler.Begin(SectionDraw);
+        renderer.Draw(time);
+        profiler.End(SectionDraw);
+    }
+    
+    // Writes the plan as SVG with world units as user units. Every mesh is defined once with its
+    // shape and the shared paint of its material, and each item references its mesh with its world
+    // transformation, in draw order. Items are formatted in parallel chunks and written a window of
+    // chunks at a time, so the memory stays the same however large the plan is. Returns the size of
+    // the file, -1 if it cannot be written.
+    long long ExportSvg(const char* filename, float time) {
+        const int chunkSize = 4096;
+        const int windowChunks = 16;
+        UpdateTransforms();
+        vec2 min, max;
+        if (!GetBounds(min, max)) {
+            min = vec2(-1, -1);
+            max = vec2(1, 1);
+        }
+        FILE* file = fopen(filename, "wb");
+        if (!file) { printf("Cannot write %s\n", filename); return -1; }
+        
+        // the y axis points up in the plan and down in SVG
+        fprintf(file, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                "<svg xmlns=\"http://www.w3.org/2000/svg\" xmlns:xlink=\"http://www.w3.org/1999/xlink\" "
+                "viewBox=\"%g %g %g %g\">\n<defs>\n", min.x, -max.y, max.x - min.x, max.y - min.y);
+        std::string definitions;
+        std::vector<std::string> paints(materials.size());
+        for (int i = 0; i < materials.size(); i++) paints[i] = materials[i]->GetSvgPaint(Format("p%d", i), time, definitions);
+        for (int i = 0; i < meshes.size(); i++) {
+            meshes[i]->SetIndex(i);
+            int material = (int)(std::find(materials.begin(), materials.end(), meshes[i]->GetMaterial()) - materials.begin());
+            definitions += Format("<g id=\"m%d\" fill=\"%s\">", meshes[i]->GetIndex(), paints[material].c_str()) +
+                           meshes[i]->GetGeometry()->GetSvgShape() + "</g>\n";
+        }
+        fputs(definitions.c_str(), file);
+        fputs("</defs>\n<g transform=\"scale(1 -1)\">\n", file);
+        
+        int placementCount = (int)placements.size();
+        int count = placementCount + (int)objects.size();
+        std::vector<std::string> chunks(windowChunks);
+        for (int first = 0; first < count; first += windowChunks * chunkSize) {
+            int windowCount = (int)fmin(count - first, windowChunks * chunkSize);
+            jobs.ParallelFor(windowCount, chunkSize, [&](int begin, int end) {
+                std::string& chunk = chunks[begin / chunkSize];
+                chunk.clear();
+                for (int i = first + begin; i < first + end; i++) {
+                    Mesh* mesh;
+                    mat4 M;
+                    if (i < placementCount) {
+                        mesh = placements[i].mesh;
+                        M = placements[i].GetModelMatrix();
+                    }
+                    else {
+                        mesh = objects[i - placementCount]->GetMesh();
+                        M = objects[i - placementCount]->GetWorldMatrix();
+                    }
+                    chunk += Format("<use xlink:href=\"#m%d\" transform=\"matrix(%g %g %g %g %g %g)\"/>\n",
+                                    mesh->GetIndex(), M.m[0][0], M.m[0][1], M.m[1][0], M.m[1][1], M.m[3][0], M.m[3][1]);
+                }
+            });
+            for (int c = 0; c * chunkSize < windowCount; c++) fwrite(chunks[c].data(), 1, chunks[c].size(), file);
+        }
+        
+        fputs("</g>\n</svg>\n", file);
+        long long size = ftell(file);
+        bool ok = !ferror(file);
+        fclose(file);
+        if (!ok) { printf("Cannot write %s\n", filename); return -1; }
+        return size;
+    }
+    
+    // FNV-1a over everything an edit can change: mesh, model matrix, selection and conflict state of
+    // every item. Equal plans give equal hashes on any machine, so a replay can check its result.
+    unsigned long long Hash() {
+        UpdateTransforms();
+        for (int i = 0; i < meshes.size(); i++) meshes[i]->SetIndex(i);
+        unsigned long long hash = 14695981039346656037ull;
+        auto add = [&](const void* data, size_t size) {
+            const unsigned char* bytes = (const unsigned char*)data;
+            for (size_t i = 0; i < size; i++) hash = (hash ^ bytes[i]) * 1099511628211ull;
+        };
+        auto addItem = [&](Mesh* mesh, mat4 M, bool selected, bool conflict) {
+            int index = mesh->GetIndex();
+            float values[6] = { M.m[0][0], M.m[0][1], M.m[1][0], M.m[1][1], M.m[3][0], M.m[3][1] };
+            unsigned char flags = (selected ? 1 : 0) | (conflict ? 2 : 0);
+            add(&index, sizeof(index));
+            add(values, sizeof(values));
+            add(&flags, 1);
+        };
+        for (int i = 0; i < placements.size(); i++) {
+            addItem(placements[i].mesh, placements[i].GetModelMatrix(), false, placements[i].conflict);
+        }
+        for (int i = 0; i < objects.size(); i++) {
+            addItem(objects[i]->GetMesh(), objects[i]->GetWorldMatrix(), objects[i]->GetSelected(), objects[i]->conflict);
+        }
+        return hash;
+    }
+    
+    void Draw()
+    {
+        profiler.Begin(SectionCull);
+        std::vector<Object*> visible;
+        for(int i = 0; i < objects.size(); i++) {
+            if (camera.IsVisible(objects[i]->GetDrawPosition(), objects[i]->GetBoundingRadius()))
+                visible.push_back(objects[i]);
+        }
+        profiler.End(SectionCull);
+        
+        profiler.Begin(SectionDraw);
+        for(int i = 0; i < visible.size(); i++) {
+            visible[i]->GetShader()->Run();
+            visible[i]->Draw();
+        }
+        profiler.End(SectionDraw);
+    }
+};
+
+// Out-of-core storage for venues too large to keep resident. A cell file buckets the items into
+// square cells and only stores the furniture kind, position and transformation of each. A loader
+// thread reads the cells around the camera, the render thread turns them into static instance
+// buffers in world space, and the cells that were wanted longest ago are dropped when the memory
+// budget is exhausted. The render thread never touches the file.
+class CellPager
+{
+    struct FileHeader
+    {
+        char magic[8];              // "EPCELLS1"
+        float cellSize;
+        int columns, rows;          // cell 0 has its lower left corner at the origin
+        float maxRadius;            // items reach at most this far out of their cell
+    };
+    
+    struct FileCell
+    {
+        long long offset;                   // of the first item in the file
+        int counts[FurnitureKindCount];     // items per kind, stored in kind order
+    };
+    
+    struct FileItem
+    {
+        float position[2];
+        float transform[4];         // scaling and rotation, like Placement
+    };
+    
+    enum CellState { CellUnloaded, CellQueued, CellResident, CellFailed };     // failed cells are not read again
+    
+    struct Cell
+    {
+        FileCell file;
+        int state = CellUnloaded;
+        size_t bytes = 0;           // counted against the budget from the request on
+        unsigned int buffer = 0;    // InstanceData in world space while resident
+        long long lastWanted = 0;   // frame in which the cell was last around the view
+    };
+    
+    static const int uploadsPerFrame = 4;
+    
+    std::string path;
+    FileHeader header;
+    std::vector<Cell> cells;
+    std::vector<int> resident;
+    Mesh* meshes[FurnitureKindCount];
+    vec4 colors[FurnitureKindCount];    // read by the loader thread
+    size_t budget;
+    size_t used;
+    int queued;                 // cells requested and not uploaded or dropped yet
+    long long frame;
+    
+    // shared with the loader thread
+    std::thread loader;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<int> requests;
+    std::vector<std::pair<int, std::vector<InstanceData>>> finished;
+    std::atomic<int> arrivals;
+    bool stop;
+    
+    void LoaderLoop() {
+        FILE* file = fopen(path.c_str(), "rb");
+        std::vector<FileItem> items;
+        while (true) {
+            int index;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this]() { return stop || !requests.empty(); });
+                if (stop) break;
+                index = requests.front();
+                requests.pop_front();
+            }
+            const FileCell& cell = cells[index].file;
+            int total = 0;
+            for (int k = 0; k < FurnitureKindCount; k++) total += cell.counts[k];
+            items.resize(total);
+            if (!file || fseek(file, (long)cell.offset, SEEK_SET) != 0 ||
+                fread(&items[0], sizeof(FileItem), total, file) != total) {
+                printf("Cannot read cell %d of %s\n", index, path.c_str());
+                total = 0;
+            }
+            std::vector<InstanceData> data(total);
+            for (int k = 0, i = 0; k < FurnitureKindCount; k++) {
+                for (int end = i + cell.counts[k]; i < end && i < total; i++) {
+                    InstanceData instance = { { items[i].transform[0], items[i].transform[1], items[i].transform[2],
+                                                items[i].transform[3] },
+                                              { items[i].position[0], items[i].position[1], 0, 1 },
+                                              { colors[k].v[0], colors[k].v[1], colors[k].v[2], 1 } };
+                    data[i] = instance;
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                finished.push_back(std::make_pair(index, std::move(data)));
+            }
+            arrivals++;
+        }
+        if (file) fclose(file);
+    }
+    
+    // cell range around the world space rectangle, grown by margin cells, exclusive at the end
+    void GetRange(vec2 min, vec2 max, int margin, int& x0, int& y0, int& x1, int& y1) {
+        float r = header.maxRadius;
+        x0 = (int)fmax(floorf((min.x - r) / header.cellSize) - margin, 0);
+        y0 = (int)fmax(floorf((min.y - r) / header.cellSize) - margin, 0);
+        x1 = (int)fmin(floorf((max.x + r) / header.cellSize) + 1 + margin, header.columns);
+        y1 = (int)fmin(floorf((max.y + r) / header.cellSize) + 1 + margin, header.rows);
+    }
+    
+    void Release(Cell& cell) {
+        if (cell.buffer) glDeleteBuffers(1, &cell.buffer);
+        cell.buffer = 0;
+        cell.state = CellUnloaded;
+        used -= cell.bytes;
+    }
+    
+    // drops resident cells that are not around the view, oldest first, until bytes more fit
+    bool Evict(size_t bytes) {
+        std::sort(resident.begin(), resident.end(), [this](int a, int b) {
+            return cells[a].lastWanted < cells[b].lastWanted;
+        });
+        int dropped = 0;
+        while (used + bytes > budget && dropped < resident.size() && cells[resident[dropped]].lastWanted != frame) {
+            Release(cells[resident[dropped]]);
+            dropped++;
+        }
+        resident.erase(resident.begin(), resident.begin() + dropped);
+        return used + bytes <= budget;
+    }
+    
+public:
+    CellPager() : arrivals(0) {
+        budget = 64 << 20;
+        used = 0;
+        queued = 0;
+        frame = 0;
+        stop = false;
+    }
+    
+    ~CellPager() {
+        Close();
+    }
+    
+    // Generates a venue of count items in halls of alternating layouts and writes it as a cell file.
+    // Every hall gets its own block of cells, so the halls are generated and written one at a time.
+    static bool WriteExpo(const char* filename, Scene& scene, int count, float cellSize = 8) {
+        const int hallItems = 250000;
+        int halls = (int)fmax((count + hallItems - 1) / hallItems, 1);
+        int perHall = (count + halls - 1) / halls;
+        float extent = (float)sqrt((double)perHall) * 0.3f * 0.6f + 0.5f;     // of a banquet, see LayoutGenerator::Begin
+        int block = (int)ceil((2 * extent + cellSize) / cellSize);              // cells per hall side, with an aisle
+        int hallColumns = (int)ceil(sqrt((double)halls));
+        int hallRows = (halls + hallColumns - 1) / hallColumns;
+        
+        FileHeader header = { { 'E', 'P', 'C', 'E', 'L', 'L', 'S', '1' }, cellSize, hallColumns * block,
+                              hallRows * block, 0 };
+        std::vector<FileCell> index(header.columns * header.rows);
+        memset(&index[0], 0, index.size() * sizeof(FileCell));
+        FILE* file = fopen(filename, "wb");
+        if (!file) { printf("Cannot write %s\n", filename); return false; }
+        fwrite(&header, sizeof(header), 1, file);
+        fwrite(&index[0], sizeof(FileCell), index.size(), file);
+        long long offset = sizeof(header) + index.size() * sizeof(FileCell);
+        
+        Mesh* meshes[FurnitureKindCount];
+        for (int k = 0; k < FurnitureKindCount; k++) meshes[k] = scene.GetFurnitureMesh((FurnitureKind)k);
+        std::vector<Placement> hall;
+        std::vector<std::vector<FileItem>> buckets(block * block * FurnitureKindCount);
+        int written = 0;
+        for (int h = 0; h < halls; h++) {
+            int hx = h % hallColumns * block, hy = h / hallColumns * block;
+            vec2 center((hx + block * 0.5f) * cellSize, (hy + block * 0.5f) * cellSize);
+            hall.clear();
+            scene.GenerateLayout((LayoutKind)(h % 3), center, perHall, hall);
+            for (int b = 0; b < buckets.size(); b++) buckets[b].clear();
+            for (int i = 0; i < hall.size(); i++) {
+                Placement& placement = hall[i];
+                int kind = placement.mesh == meshes[FurnitureTable] ? FurnitureTable :
+                           placement.mesh == meshes[FurnitureChair] ? FurnitureChair : FurniturePlant;
+                int cx = (int)fmin(fmax(floorf(placement.position.x / cellSize) - hx, 0), block - 1);
+                int cy = (int)fmin(fmax(floorf(placement.position.y / cellSize) - hy, 0), block - 1);
+                FileItem item = { { placement.position.x, placement.position.y },
+                                  { placement.transform[0], placement.transform[1], placement.transform[2],
+                                    placement.transform[3] } };
+                buckets[(cy * block + cx) * FurnitureKindCount + kind].push_back(item);
+                header.maxRadius = fmax(header.maxRadius, placement.radius);
+            }
+            for (int cy = 0; cy < block; cy++) {
+                for (int cx = 0; cx < block; cx++) {
+                    FileCell& cell = index[(hy + cy) * header.columns + hx + cx];
+                    cell.offset = offset;
+                    for (int k = 0; k < FurnitureKindCount; k++) {
+                        std::vector<FileItem>& items = buckets[(cy * block + cx) * FurnitureKindCount + k];
+                        cell.counts[k] = (int)items.size();
+                        if (!items.empty()) fwrite(&items[0], sizeof(FileItem), items.size(), file);
+                        offset += items.size() * sizeof(FileItem);
+                    }
+                }
+            }
+            written += (int)hall.size();
+        }
+        
+        // the index is complete now
+        fseek(file, 0, SEEK_SET);
+        fwrite(&header, sizeof(header), 1, file);
+        fwrite(&index[0], sizeof(FileCell), index.size(), file);
+        bool ok = !ferror(file);
+        fclose(file);
+        if (ok) printf("Wrote %d items in %d halls to %s\n", written, halls, filename);
+        else printf("Cannot write %s\n", filename);
+        return ok;
+    }
+    
+    // reads the cell index and starts the loader thread, budget is in bytes
+    bool Open(const char* filename, Scene& scene, size_t budgetBytes) {
+        Close();
+        FILE* file = fopen(filename, "rb");
+        if (!file) { printf("Cannot open %s\n", filename); return false; }
+        bool ok = fread(&header, sizeof(header), 1, file) == 1 && !memcmp(header.magic, "EPCELLS1", 8) &&
+                  header.columns > 0 && header.rows > 0;
+        if (ok) {
+            std::vector<FileCell> index(header.columns * header.rows);
+            ok = fread(&index[0], sizeof(FileCell), index.size(), file) == index.size();
+            cells.resize(index.size());
+            for (int i = 0; ok && i < index.size(); i++) {
+                cells[i].file = index[i];
+                cells[i].bytes = 0;
+                for (int k = 0; k < FurnitureKindCount; k++) cells[i].bytes += index[i].counts[k] * sizeof(InstanceData);
+            }
+        }
+        fclose(file);
+        if (!ok) {
+            printf("%s is not a cell file\n", filename);
+            cells.clear();
+            return false;
+        }
+        
+        path = filename;
+        budget = budgetBytes;
+        for (int k = 0; k < FurnitureKindCount; k++) {
+            meshes[k] = scene.GetFurnitureMesh((FurnitureKind)k);
+            colors[k] = meshes[k]->GetMaterial()->GetColor();
+        }
+        stop = false;
+        loader = std::thread(&CellPager::LoaderLoop, this);
+        return true;
+    }
+    
+    void Close() {
+        if (!loader.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        wake.notify_all();
+        loader.join();
+        for (int i = 0; i < resident.size(); i++) Release(cells[resident[i]]);
+        resident.clear();
+        requests.clear();
+        finished.clear();
+        arrivals = 0;
+        cells.clear();
+        used = 0;
+        queued = 0;
+    }
+    
+    bool IsOpen() {
+        return !cells.empty();
+    }
+    
+    // center of the first cell that holds anything, somewhere to start looking
+    vec2 GetStart() {
+        for (int i = 0; i < cells.size(); i++) {
+            if (cells[i].bytes > 0)
+                return vec2((i % header.columns + 0.5f) * header.cellSize, (i / header.columns + 0.5f) * header.cellSize);
+        }
+        return vec2(0, 0);
+    }
+    
+    // true while requested cells have not arrived yet
+    bool IsLoading() {
+        return queued > 0;
+    }
+    
+    // the loader has finished cells that the next Update uploads
+    bool HasArrivals() {
+        return arrivals > 0;
+    }
+    
+    size_t GetUsedBytes() {
+        return used;
+    }
+    
+    int GetResidentCount() {
+        return (int)resident.size();
+    }
+    
+    // Called once per frame before Draw on the render thread. Uploads a few of the cells the loader
+    // has read and requests the missing cells around the view, nearest first, making room by evicting
+    // the cells that were wanted longest ago. Cells that left the view before they arrived are
+    // dropped, so panning quickly does not leave a backlog.
+    void Update(Camera& camera) {
+        if (!IsOpen()) return;
+        frame++;
+        vec2 min = camera.ScreenToWorld(vec2(-1, -1)), max = camera.ScreenToWorld(vec2(1, 1));
+        int x0, y0, x1, y1;
+        GetRange(min, max, 1, x0, y0, x1, y1);      // one ring of cells ahead of the view
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) cells[y * header.columns + x].lastWanted = frame;
+        }
+        
+        std::vector<std::pair<int, std::vector<InstanceData>>> arrived;
+        std::vector<int> cancelled;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            int n = (int)fmin(finished.size(), uploadsPerFrame);
+            for (int i = 0; i < n; i++) arrived.push_back(std::move(finished[i]));
+            finished.erase(finished.begin(), finished.begin() + n);
+            for (auto request = requests.begin(); request != requests.end();) {
+                if (cells[*request].lastWanted == frame) { ++request; continue; }
+                cancelled.push_back(*request);
+                request = requests.erase(request);
+            }
+        }
+        arrivals -= (int)arrived.size();
+        for (int i = 0; i < cancelled.size(); i++) {
+            Release(cells[cancelled[i]]);
+            queued--;
+        }
+        for (int i = 0; i < arrived.size(); i++) {
+            Cell& cell = cells[arrived[i].first];
+            std::vector<InstanceData>& data = arrived[i].second;
+            queued--;
+            if (cell.lastWanted != frame || data.empty()) {
+                Release(cell);
+                if (data.empty()) cell.state = CellFailed;     // the loader could not read it
+                continue;
+            }
+            glGenBuffers(1, &cell.buffer);
+            glBindBuffer(GL_ARRAY_BUFFER, cell.buffer);
+            glBufferData(GL_ARRAY_BUFFER, data.size() * sizeof(InstanceData), &data[0], GL_STATIC_DRAW);
+            cell.state = CellResident;
+            resident.push_back(arrived[i].first);
+        }
+        
+        std::vector<int> missing;
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) {
+                Cell& cell = cells[y * header.columns + x];
+                if (cell.state == CellUnloaded && cell.bytes > 0) missing.push_back(y * header.columns + x);
+            }
+        }
+        vec2 center((min.x + max.x) * 0.5f, (min.y + max.y) * 0.5f);
+        auto distance = [&](int i) {
+            float dx = (i % header.columns + 0.5f) * header.cellSize - center.x;
+            float dy = (i / header.columns + 0.5f) * header.cellSize - center.y;
+            return dx * dx + dy * dy;
+        };
+        std::sort(missing.begin(), missing.end(), [&](int a, int b) { return distance(a) < distance(b); });
+        int requested = 0;
+        for (; requested < missing.size(); requested++) {
+            Cell& cell = cells[missing[requested]];
+            if (used + cell.bytes > budget && !Evict(cell.bytes)) break;
+            cell.state = CellQueued;
+            used += cell.bytes;
+            queued++;
+        }
+        if (!requested) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            requests.insert(requests.end(), missing.begin(), missing.begin() + requested);
+        }
+        wake.notify_one();
+    }
+    
+    // draws the resident cells in view below everything else, one instanced call per kind and cell
+    void Draw(Camera& camera) {
+        if (resident.empty()) return;
+        vec2 min = camera.ScreenToWorld(vec2(-1, -1)), max = camera.ScreenToWorld(vec2(1, 1));
+        int x0, y0, x1, y1;
+        GetRange(min, max, 0, x0, y0, x1, y1);
+        mat4 V = camera.GetViewTransformationMatrix();
+        vec4 view(V.m[0][0], V.m[1][1], V.m[3][0], V.m[3][1]);
+        
+        Shader* current = 0;
+        for (int i = 0; i < resident.size(); i++) {
+            Cell& cell = cells[resident[i]];
+            int x = resident[i] % header.columns, y = resident[i] / header.columns;
+            if (x < x0 || x >= x1 || y < y0 || y >= y1) continue;
+            size_t offset = 0;
+            for (int k = 0; k < FurnitureKindCount; k++) {
+                int count = cell.file.counts[k];
+                if (!count) continue;
+                Material* material = meshes[k]->GetMaterial();
+                if (material->GetShader() != current) {
+                    current = material->GetShader();
+                    current->RunInstanced(view);
+                }
+                material->UploadAttributes();
+                meshes[k]->GetGeometry()->DrawInstanced(cell.buffer, offset, count);
+                offset += count * sizeof(InstanceData);
+            }
+        }
+    }
+};
+
+CellPager cellPager;
+
+Scene *gScene = 0;
+
+// while replaying input the application runs on this clock instead of the wall clock, negative otherwise
+double virtualClock = -1;
+
+// time elapsed since program started, in seconds
+double GetElapsedTime() {
+    if (virtualClock >= 0) return virtualClock;
+    return glutGet(GLUT_ELAPSED_TIME) * 0.001;
+}
+
+void onIdle();
+
+// enable (1) or disable (0) waiting for the vertical retrace in glutSwapBuffers
+void SetSwapInterval(int interval) {
+#if defined(__APPLE__)
+    GLint value = interval;
+    CGLSetParameter(CGLGetCurrentContext(), kCGLCPSwapInterval, &value);
+#elif defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+    typedef BOOL (WINAPI *SwapIntervalProc)(int);
+    SwapIntervalProc swapInterval = (SwapIntervalProc)wglGetProcAddress("wglSwapIntervalEXT");
+    if (swapInterval) swapInterval(interval);
+#else
+    typedef int (*SwapIntervalProc)(int);
+    SwapIntervalProc swapInterval = (SwapIntervalProc)glXGetProcAddressARB((const GLubyte*)"glXSwapIntervalMESA");
+    if (!swapInterval) swapInterval = (SwapIntervalProc)glXGetProcAddressARB((const GLubyte*)"glXSwapIntervalSGI");
+    if (swapInterval) swapInterval(interval);
+#endif
+}
+
+// Drives the simulation with a fixed time step and only asks GLUT for a new frame when the
+// scene has actually changed. When nothing moves the idle callback is unregistered, so a static
+// plan does not use any CPU until the next input event wakes the scheduler up again.
+class FrameScheduler {
+    double step;            // simulation time step in seconds
+    double maxFrameTime;    // longest real time interval simulated at once, avoids the spiral of death
+    double frameInterval;   // minimum seconds between two rendered frames, 0 means uncapped
+    double accumulator;
+    double lastTime;
+    double lastFrameTime;
+    bool dirty;
+    bool running;
+    bool headless;          // driven by a loop of its own instead of the GLUT idle callback
+    bool redisplay;         // headless: a frame is due
+    
+public:
+    FrameScheduler(double step = 1.0 / 120.0) : step(step) {
+        maxFrameTime = 0.25;
+        frameInterval = 0;
+        accumulator = 0;
+        lastTime = 0;
+        lastFrameTime = -1;
+        dirty = true;
+        running = false;
+        headless = false;
+        redisplay = false;
+    }
+    
+    // without a window there is no idle callback to register and no display to post to, the
+    // caller ticks the scheduler and asks with TakeRedisplay whether to render a frame
+    void SetHeadless(bool enable) {
+        headless = enable;
+    }
+    
+    bool TakeRedisplay() {
+        bool due = redisplay;
+        redisplay = false;
+        return due;
+    }
+    
+    void SetFrameCap(double fps) {
+        frameInterval = fps > 0 ? 1.0 / fps : 0;
+    }
+    
+    double GetStep() {
+        return step;
+    }
+    
+    // register the idle callback again after the scheduler went to sleep
+    void Wake() {
+        if (running) return;
+        running = true;
+        accumulator = 0;
+        lastTime = GetElapsedTime();
+        if (!headless) glutIdleFunc(onIdle);
+    }
+    
+    // the scene has changed and must be redrawn
+    void Invalidate() {
+        dirty = true;
+        Wake();
+    }
+    
+    bool IsRunning() {
+        return running;
+    }
+    
+    // called from the idle callback: runs the pending simulation steps and decides whether to render
+    template<typename Update, typename Active>
+    void Tick(Update update, Active active) {
+        double t = GetElapsedTime();
+        double frameTime = fmin(fabs(t - lastTime), maxFrameTime);
+        lastTime = t;
+        
+        accumulator += frameTime;
+        profiler.Begin(SectionUpdate);
+        while (accumulator >= step) {
+            if (update(step)) dirty = true;
+            accumulator -= step;
+        }
+        profiler.End(SectionUpdate);
+        if (gScene->HasVisibleAnimation(camera)) dirty = true;
+        
+        if (dirty) {
+            double wait = lastFrameTime + frameInterval - t;
+            if (frameInterval > 0 && wait > 0) {
+                // frame cap: give the core back instead of spinning until the next frame is due
+                if (!headless) std::this_thread::sleep_for(std::chrono::duration<double>(fmin(wait, step)));
+                return;
+            }
+            lastFrameTime = t;
+            dirty = false;
+            if (headless) redisplay = true;
+            else glutPostRedisplay();
+        }
+        else if (!active()) {
+            // nothing left to simulate: sleep until input arrives
+            running = false;
+            if (!headless) glutIdleFunc(NULL);
+        }
+        else if (!headless) {
+            std::this_thread::sleep_for(std::chrono::duration<double>(fmax(step - accumulator, 0.0)));
+        }
+    }
+};
+
+FrameScheduler scheduler;
+
+class OverlayShader : public Shader
+{
+    
+public:
+    OverlayShader() : Shader("overlay")
+    {
+        // vertex shader in GLSL
+        const char *vertexSource = R"(
+#version 410
+        precision highp float;
+        
+        in vec2 vertexPosition;        // already in normalized device coordinates
+        in vec4 vertexColor;
+        out vec4 color;
+        
+        void main()
+        {
+            color = vertexColor;
+            gl_Position = vec4(vertexPosition.x, vertexPosition.y, 0, 1);
+        }
+        )";
+        
+        // fragment shader in GLSL
+        const char *fragmentSource = R"(
+#version 410
+        precision highp float;
+        
+        in vec4 color;
+        out vec4 fragmentColor;
+        
+        void main()
+        {
+            fragmentColor = color;
+        }
+        )";
+        
+        Build(vertexSource, fragmentSource, false);
+    }
+};
+
+// Draws the frame time history of the profiler as a bar graph in the lower left corner and
+// shows the rolling percentiles in the window title.
+class ProfilerOverlay
+{
+    static const int bars = 120;
+    
+    OverlayShader* shader;
+    unsigned int vao, vbo;
+    std::vector<float> vertices;    // x, y, r, g, b, a per vertex
+    bool visible;
+    double lastTitleUpdate;
+    
+    void AddQuad(float x0, float y0, float x1, float y1, float r, float g, float b, float a) {
+        float corners[6][2] = { {x0, y0}, {x1, y0}, {x1, y1}, {x0, y0}, {x1, y1}, {x0, y1} };
+        for (int i = 0; i < 6; i++) {
+            float vertex[6] = { corners[i][0], corners[i][1], r, g, b, a };
+            vertices.insert(vertices.end(), vertex, vertex + 6);
+        }
+    }
+    
+public:
+    ProfilerOverlay() {
+        shader = 0;
+        vao = vbo = 0;
+        visible = false;
+        lastTitleUpdate = 0;
+    }
+    
+    void Initialize() {
+        shader = new OverlayShader();
+        shader->Finish();
+        glGenVertexArrays(1, &vao);
+        glBindVertexArray(vao);
+        glGenBuffers(1, &vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 6 * sizeof(float), NULL);
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(2 * sizeof(float)));
+    }
+    
+    void Toggle() {
+        visible = !visible;
+        if (!visible && !softwareOnly) glutSetWindowTitle("Triangle Rendering");
+    }
+    
+    OverlayShader* GetShader() {
+        return shader;
+    }
+    
+    void Draw() {
+        if (!visible) return;
+        
+        double now = profiler.Now();
+        if (now - lastTitleUpdate > 0.5) {
+            char title[256];
+            profiler.PrintSummary(title, sizeof(title));
+            glutSetWindowTitle(title);
+            lastTitleUpdate = now;
+        }
+        
+        // bar height 0.5 corresponds to 33.3 ms
+        const float left = -0.98f, bottom = -0.98f, width = 0.8f, height = 0.5f, scale = height / 0.0333f;
+        float barWidth = width / bars;
+        vertices.clear();
+        AddQuad(left, bottom, left + width, bottom + height, 0, 0, 0, 0.6f);
+        
+        int count = profiler.GetFrameCount();
+        int first = count > bars ? count - bars : 0;
+        for (int i = first; i < count; i++) {
+            FrameRecord& record = profiler.GetFrame(i);
+            float x = left + (i - first) * barWidth;
+            double frame = record.duration[SectionFrame];
+            float r = frame > 0.0333 ? 1 : frame > 0.0167 ? 1 : 0.2f;
+            float g = frame > 0.0333 ? 0.2f : 1;
+            AddQuad(x, bottom, x + barWidth * 0.8f, bottom + fmin(frame * scale, height), r, g, 0.2f, 0.9f);
+            if (record.gpuTime >= 0)
+                AddQuad(x, bottom, x + barWidth * 0.4f, bottom + fmin(record.gpuTime * scale, height), 0.3f, 0.5f, 1, 0.9f);
+            if (record.inputLatency >= 0) {
+                // input latency as a tick, above the budget line when a drag lags behind by more than a frame
+                float y = bottom + fmin(record.inputLatency * scale, height);
+                AddQuad(x, y - 0.006f, x + barWidth * 0.8f, y, 1, 0.5f, 0, 1);
+            }
+        }
+        // 60 Hz budget line
+        AddQuad(left, bottom + 0.0167f * scale, left + width, bottom + 0.0167f * scale + 0.004f, 1, 1, 1, 0.8f);
+        
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        shader->Run();
+        glBindVertexArray(vao);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), &vertices[0], GL_STREAM_DRAW);
+        glDrawArrays(GL_TRIANGLES, 0, (int)vertices.size() / 6);
+        glDisable(GL_BLEND);
+    }
+};
+
+ProfilerOverlay profilerOverlay;
+
+// Draws the alignment guides of the current drag as lines in a single draw call.
+class GuideOverlay
+{
+    OverlayShader* shader;
+    unsigned int vao, vbo;
+    std::vector<float> vertices;    // x, y, r, g, b, a per vertex
+    
+public:
+    GuideOverlay() {
+        shader = 0;
+        vao = vbo = 0;
+    }
+    
+    // shares the program of the profiler overlay
+    void Initialize(OverlayShader* overlayShader) {
+        shader = overlayShader;
+        glGenVertexArrays(1, &vao);
+        glBindVertexArray(vao);
+        glGenBuffers(1, &vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 6 * sizeof(float), NULL);
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(2 * sizeof(float)));
+    }
+    
+    // lines holds pairs of end points in world space
+    void Draw(std::vector<vec2>& lines) {
+        if (lines.empty()) return;
+        mat4 V = camera.GetViewTransformationMatrix();
+        vertices.clear();
+        for (int i = 0; i < lines.size(); i++) {
+            vec4 p = vec4(lines[i].x, lines[i].y, 0, 1) * V;
+            float vertex[6] = { p.v[0], p.v[1], 1, 0, 1, 1 };
+            vertices.insert(vertices.end(), vertex, vertex + 6);
+        }
+        shader->Run();
+        glBindVertexArray(vao);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), &vertices[0], GL_STREAM_DRAW);
+        glDrawArrays(GL_LINES, 0, (int)lines.size());
+        profiler.CountDraw((int)lines.size());
+    }
+};
+
+GuideOverlay guideOverlay;
+
+// Writes the highlighted items into the red (selected) and green (overlapping) channels of the
+// selection mask.
+class SelectionMaskShader : public Shader
+{
+    
+public:
+    SelectionMaskShader() : Shader("selection_mask")
+    {
+        // vertex shader in GLSL
+        const char *vertexSource = R"(
+#version 410
+        precision highp float;
+        
+        in vec2 vertexPosition;
+#ifdef INSTANCED
+        in vec4 instanceTransform;     // model-view rows (m00, m01, m10, m11)
+        in vec4 instanceTranslation;   // model-view translation, depth
+        in vec3 instanceColor;         // selected, overlapping
+#else
+        uniform vec3 vertexColor;
+        uniform mat4 M;
+#endif
+        out vec3 color;
+        
+        void main()
+        {
+#ifdef INSTANCED
+            color = instanceColor;
+            gl_Position = vec4(vertexPosition.x * instanceTransform.xy + vertexPosition.y * instanceTransform.zw +
+                               instanceTranslation.xy, 0, 1);
+#else
+            color = vertexColor;
+            gl_Position = vec4(vertexPosition.x, vertexPosition.y, 0, 1) * M;
+#endif
+        }
+        )";
+        
+        // fragment shader in GLSL
+        const char *fragmentSource = R"(
+#version 410
+        precision highp float;
+        
+        in vec3 color;
+        out vec4 fragmentColor;
+        
+        void main()
+        {
+            fragmentColor = vec4(color, 1);
+        }
+        )";
+        
+        Build(vertexSource, fragmentSource, true);
+    }
+};
+
+// Full screen pass that draws an outline around the shapes in the selection mask, white for the
+// selection and red for overlaps, and tints the selected shapes slightly.
+class SelectionOutlineShader : public Shader
+{
+    
+public:
+    SelectionOutlineShader() : Shader("selection_outline")
+    {
+        // vertex shader in GLSL
+        const char *vertexSource = R"(
+#version 410
+        precision highp float;
+        
+        void main()
+        {
+            // a single triangle covering the screen, no vertex data needed
+            vec2 p = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+            gl_Position = vec4(p * 2.0 - 1.0, 0, 1);
+        }
+        )";
+        
+        // fragment shader in GLSL
+        const char *fragmentSource = R"(
+#version 410
+        precision highp float;
+        
+        uniform sampler2D mask;
+        uniform int width;             // of the outline in pixels
+        out vec4 fragmentColor;
+        
+        void main()
+        {
+            ivec2 size = textureSize(mask, 0);
+            ivec2 p = ivec2(gl_FragCoord.xy);
+            vec2 inside = texelFetch(mask, p, 0).rg;
+            vec2 around = inside;
+            for (int y = -width; y <= width; y++) {
+                for (int x = -width; x <= width; x++) {
+                    around = max(around, texelFetch(mask, clamp(p + ivec2(x, y), ivec2(0), size - 1), 0).rg);
+                }
+            }
+            vec2 outline = around - inside;
+            if (outline.g > 0.5) fragmentColor = vec4(1, 0.1, 0.1, 1);
+            else if (outline.r > 0.5) fragmentColor = vec4(1, 1, 1, 1);
+            else if (inside.r > 0.5) fragmentColor = vec4(1, 1, 1, 0.2);
+            else discard;
+        }
+        )";
+        
+        Build(vertexSource, fragmentSource, false);
+    }
+    
+    void UploadMask(int unit) {
+        int location = GetUniformLocation("mask");
+        if (location >= 0) glUniform1i(location, unit);
+        else printf("uniform mask cannot be set\n");
+    }
+    
+    void UploadWidth(int width) {
+        int location = GetUniformLocation("width");
+        if (location >= 0) glUniform1i(location, width);
+        else printf("uniform width cannot be set\n");
+    }
+};
+
+// Selection highlighting as a post-process: the highlighted items are rendered into a mask
+// texture, and one full screen pass draws their outlines over the finished frame. The main draw
+// does not depend on the selection at all. The mask is drawn without depth testing on purpose:
+// outlines of selected or overlapping items stay visible where other items cover them.
+class SelectionOutline
+{
+    SelectionMaskShader* maskShader;
+    SelectionOutlineShader* outlineShader;
+    unsigned int framebuffer, texture, vao;
+    int width, height;
+    StreamBuffer stream;
+    std::vector<std::vector<InstanceData>> batches;     // per mesh index
+    
+public:
+    SelectionOutline() {
+        maskShader = 0;
+        outlineShader = 0;
+        framebuffer = texture = vao = 0;
+        width = height = 0;
+    }
+    
+    // the mask has the size of the framebuffer the outlines are drawn into
+    void Initialize(int w, int h, bool persistentBuffers) {
+        width = w;
+        height = h;
+        maskShader = new SelectionMaskShader();
+        outlineShader = new SelectionOutlineShader();
+        maskShader->Finish();
+        outlineShader->Finish();
+        
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RG8, width, height, 0, GL_RG, GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glGenFramebuffers(1, &framebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            printf("Selection mask framebuffer is incomplete\n");
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        
+        glGenVertexArrays(1, &vao);     // core profiles need one bound even without attributes
+        stream.Initialize(persistentBuffers);
+    }
+    
+    // draws the outlines into the bound framebuffer, does nothing if nothing is highlighted
+    void Draw(Scene& scene) {
+        int total = scene.CollectHighlights(batches);
+        if (!total) return;
+        
+        InstanceData* data = (InstanceData*)stream.Begin(total * sizeof(InstanceData));
+        std::vector<int> offsets(batches.size());
+        int offset = 0;
+        for (int m = 0; m < batches.size(); m++) {
+            offsets[m] = offset;
+            if (!batches[m].empty()) memcpy(data + offset, &batches[m][0], batches[m].size() * sizeof(InstanceData));
+            offset += (int)batches[m].size();
+        }
+        stream.End();
+        
+        int target = 0;
+        glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &target);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glViewport(0, 0, width, height);
+        glClearColor(0, 0, 0, 0);
+        glClear(GL_COLOR_BUFFER_BIT);
+        maskShader->RunInstanced();
+        std::vector<Mesh*> meshes = scene.GetMeshes();
+        for (int m = 0; m < batches.size(); m++) {
+            if (batches[m].empty()) continue;
+            meshes[m]->GetGeometry()->DrawInstanced(stream.GetBuffer(),
+                stream.GetOffset() + offsets[m] * sizeof(InstanceData), (int)batches[m].size());
+        }
+        stream.Fence();
+        glBindFramebuffer(GL_FRAMEBUFFER, target);
+        
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        outlineShader->Run();
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        outlineShader->UploadMask(0);
+        outlineShader->UploadWidth(2);
+        glBindVertexArray(vao);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        profiler.CountDraw(3);
+        glDisable(GL_BLEND);
+    }
+};
+
+SelectionOutline selectionOutline;
+
+// Colors the occupancy grid of the density map and lays it over the plan in world space.
+class DensityOverlayShader : public Shader
+{
+    
+public:
+    DensityOverlayShader() : Shader("density_overlay")
+    {
+        // vertex shader in GLSL
+        const char *vertexSource = R"(
+#version 410
+        precision highp float;
+        
+        uniform vec4 bounds;           // lower left and upper right corner of the grid in world space
+        uniform vec4 view;             // scale and offset of the camera
+        out vec2 texCoord;
+        
+        void main()
+        {
+            // a quad as a triangle strip, no vertex data needed
+            vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+            texCoord = corner;
+            gl_Position = vec4(mix(bounds.xy, bounds.zw, corner) * view.xy + view.zw, 0, 1);
+        }
+        )";
+        
+        // fragment shader in GLSL
+        const char *fragmentSource = R"(
+#version 410
+        precision highp float;
+        
+        uniform sampler2D density;
+        in vec2 texCoord;
+        out vec4 fragmentColor;
+        
+        void main()
+        {
+            float d = texture(density, texCoord).r;
+            if (d < 0.01) discard;
+            // blue for sparse, yellow for half covered, red for packed areas
+            vec3 color = d < 0.5 ? mix(vec3(0, 0.3, 1), vec3(1, 1, 0), d * 2.0) : mix(vec3(1, 1, 0), vec3(1, 0, 0), d * 2.0 - 1.0);
+            fragmentColor = vec4(color, 0.25 + 0.4 * d);
+        }
+        )";
+        
+        Build(vertexSource, fragmentSource, false);
+    }
+    
+    void UploadDensity(int unit) {
+        int location = GetUniformLocation("density");
+        if (location >= 0) glUniform1i(location, unit);
+        else printf("uniform density cannot be set\n");
+    }
+    
+    void UploadBounds(vec4 bounds) {
+        int location = GetUniformLocation("bounds");
+        if (location >= 0) glUniform4f(location, bounds.v[0], bounds.v[1], bounds.v[2], bounds.v[3]);
+        else printf("uniform bounds cannot be set\n");
+    }
+    
+    void UploadView(vec4 view) {
+        int location = GetUniformLocation("view");
+        if (location >= 0) glUniform4f(location, view.v[0], view.v[1], view.v[2], view.v[3]);
+        else printf("uniform view cannot be set\n");
+    }
+};
+
+// adds value to count consecutive counters, eight at a time
+void AddSpan(short* counts, int count, short value) {
+    int i = 0;
+#if SOFTWARE_SIMD
+    __m128i add = _mm_set1_epi16(value);
+    for (; i + 8 <= count; i += 8) {
+        __m128i* p = (__m128i*)(counts + i);
+        _mm_storeu_si128(p, _mm_add_epi16(_mm_loadu_si128(p), add));
+    }
+#endif
+    for (; i < count; i++) counts[i] += value;
+}
+
+// The footprints of all items rasterized into a grid that counts the footprints covering each
+// cell center, for the overlays that analyze the plan. The grid remembers the transformation each
+// item was rasterized with, so after a drag, rotation or delete only the changed items are
+// rasterized again, with the old footprint subtracted.
+class OccupancyGrid
+{
+    // an item as it was rasterized, x' = m0 x + m2 y + m4 and y' = m1 x + m3 y + m5 in world space
+    struct Footprint
+    {
+        Mesh* mesh;
+        float m[6];
+        
+        bool operator==(const Footprint& other) const {
+            return mesh == other.mesh && !memcmp(m, other.m, sizeof(m));
+        }
+    };
+    
+    // a footprint to add or subtract
+    struct Change
+    {
+        Footprint footprint;
+        short sign;
+        int x0, y0, x1, y1;     // cells whose centers the bounding box covers, exclusive at the end
+    };
+    
+    static const int bandRows = 16;         // rows rasterized per job
+    
+    int maxCells;               // per side of the grid
+    float margin;               // around the plan in world units
+    vec2 origin;                // lower left corner of the grid
+    float cellSize;
+    int width, height;
+    std::vector<short> counts;
+    
+    std::vector<Footprint> stamps;          // placements followed by objects, as rasterized
+    std::vector<Object*> keys;              // the objects of the stamps
+    int placementCount;
+    bool valid;
+    bool outside;                           // a change left the grid, so it has to grow
+    int changedX0, changedY0, changedX1, changedY1;     // cells changed by the last Update
+    
+    static Footprint MakeFootprint(Mesh* mesh, mat4 M) {
+        Footprint footprint = { mesh, { M.m[0][0], M.m[0][1], M.m[1][0], M.m[1][1], M.m[3][0], M.m[3][1] } };
+        return footprint;
+    }
+    
+    // the footprints of the scene in stamp order
+    static void CollectFootprints(std::vector<Placement>& placements, std::vector<Object*>& objects,
+                                  std::vector<Footprint>& out) {
+        int placementCount = (int)placements.size();
+        out.resize(placementCount + objects.size());
+        jobs.ParallelFor((int)out.size(), 4096, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                if (i < placementCount) out[i] = MakeFootprint(placements[i].mesh, placements[i].GetModelMatrix());
+                else out[i] = MakeFootprint(objects[i - placementCount]->GetMesh(), objects[i - placementCount]->GetWorldMatrix());
+            }
+        });
+    }
+    
+    Change MakeChange(const Footprint& footprint, short sign) {
+        Change change;
+        change.footprint = footprint;
+        change.sign = sign;
+        Geometry* geometry = footprint.mesh->GetGeometry();
+        vec2 lower = geometry->GetLower(), upper = geometry->GetUpper();
+        const float* m = footprint.m;
+        float minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f;
+        for (int j = 0; j < 4; j++) {
+            float x = j & 1 ? upper.x : lower.x, y = j & 2 ? upper.y : lower.y;
+            float px = (m[0] * x + m[2] * y + m[4] - origin.x) / cellSize - 0.5f;
+            float py = (m[1] * x + m[3] * y + m[5] - origin.y) / cellSize - 0.5f;
+            minX = fmin(minX, px); maxX = fmax(maxX, px);
+            minY = fmin(minY, py); maxY = fmax(maxY, py);
+        }
+        if (minX < 0 || minY < 0 || maxX >= width || maxY >= height) outside = true;
+        change.x0 = (int)fmax(ceilf(minX), 0);
+        change.y0 = (int)fmax(ceilf(minY), 0);
+        change.x1 = (int)fmin(floorf(maxX) + 1, width);
+        change.y1 = (int)fmin(floorf(maxY) + 1, height);
+        return change;
+    }
+    
+    // Adds the sign of the change to the cells of rows y0 to y1 whose centers are inside the
+    // footprint. The triangles of a fan overlap, so their spans are merged per row first.
+    void Rasterize(const Change& change, int y0, int y1, std::vector<vec2>& corners,
+                   std::vector<std::pair<int, int>>& spans) {
+        const std::vector<vec2>& triangles = change.footprint.mesh->GetGeometry()->GetTriangles();
+        const float* m = change.footprint.m;
+        corners.resize(triangles.size());
+        for (int i = 0; i < triangles.size(); i++) {
+            // in cells, with the cell centers at integer coordinates
+            vec2 p = triangles[i];
+            corners[i] = vec2((m[0] * p.x + m[2] * p.y + m[4] - origin.x) / cellSize - 0.5f,
+                              (m[1] * p.x + m[3] * p.y + m[5] - origin.y) / cellSize - 0.5f);
+        }
+        for (int y = (int)fmax(y0, change.y0); y < fmin(y1, change.y1); y++) {
+            spans.clear();
+            for (int i = 0; i < corners.size(); i += 3) {
+                float lo = 1e30f, hi = -1e30f;
+                for (int k = 0; k < 3; k++) {
+                    vec2 p = corners[i + k], q = corners[i + (k + 1) % 3];
+                    if ((p.y <= y) == (q.y <= y)) continue;
+                    float x = p.x + (y - p.y) * (q.x - p.x) / (q.y - p.y);
+                    lo = fmin(lo, x);
+                    hi = fmax(hi, x);
+                }
+                int first = (int)fmax(ceilf(lo), 0), last = (int)fmin(floorf(hi) + 1, width);
+                if (first < last) spans.push_back(std::make_pair(first, last));
+            }
+            std::sort(spans.begin(), spans.end());
+            short* row = &counts[y * width];
+            for (int i = 0; i < spans.size();) {
+                int first = spans[i].first, last = spans[i].second;
+                for (i++; i < spans.size() && spans[i].first <= last; i++) last = std::max(last, spans[i].second);
+                AddSpan(row + first, last - first, change.sign);
+            }
+        }
+    }
+    
+    // rasterizes the changes in bands of rows on the job system
+    void Apply(std::vector<Change>& changes) {
+        int x0 = width, y0 = height, x1 = 0, y1 = 0;
+        for (int i = 0; i < changes.size(); i++) {
+            x0 = std::min(x0, changes[i].x0); x1 = std::max(x1, changes[i].x1);
+            y0 = std::min(y0, changes[i].y0); y1 = std::max(y1, changes[i].y1);
+        }
+        changedX0 = x0; changedY0 = y0;
+        changedX1 = x1; changedY1 = y1;
+        if (x0 >= x1 || y0 >= y1) return;
+        jobs.ParallelFor((y1 - y0 + bandRows - 1) / bandRows, 1, [&](int begin, int end) {
+            std::vector<vec2> corners;
+            std::vector<std::pair<int, int>> spans;
+            for (int band = begin; band < end; band++) {
+                int rowBegin = y0 + band * bandRows, rowEnd = std::min(rowBegin + bandRows, y1);
+                for (int i = 0; i < changes.size(); i++) {
+                    if (changes[i].y1 > rowBegin && changes[i].y0 < rowEnd) Rasterize(changes[i], rowBegin, rowEnd, corners, spans);
+                }
+            }
+        });
+    }
+    
+    // sizes the grid to the plan and rasterizes everything
+    void Rebuild(Scene& scene) {
+        vec2 min, max;
+        if (!scene.GetBounds(min, max)) {
+            min = vec2(-1, -1);
+            max = vec2(1, 1);
+        }
+        float border = margin + 0.05f * fmax(max.x - min.x, max.y - min.y);
+        origin = vec2(min.x - border, min.y - border);
+        cellSize = fmax(fmax(max.x - min.x, max.y - min.y) + 2 * border, 0) / maxCells;
+        cellSize = fmax(cellSize, 0.02f);
+        width = std::min((int)ceilf((max.x - min.x + 2 * border) / cellSize), maxCells);
+        height = std::min((int)ceilf((max.y - min.y + 2 * border) / cellSize), maxCells);
+        counts.assign(width * height, 0);
+        
+        std::vector<Placement>& placements = scene.GetPlacements();
+        keys = scene.GetObjects();
+        placementCount = (int)placements.size();
+        CollectFootprints(placements, keys, stamps);
+        std::vector<Change> changes(stamps.size());
+        jobs.ParallelFor((int)stamps.size(), 4096, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) changes[i] = MakeChange(stamps[i], 1);
+        });
+        outside = false;
+        valid = true;
+        Apply(changes);
+        changedX0 = changedY0 = 0;
+        changedX1 = width;
+        changedY1 = height;
+    }
+    
+public:
+    OccupancyGrid(int maxCells, float margin) : maxCells(maxCells), margin(margin) {
+        width = height = 0;
+        cellSize = 1;
+        placementCount = 0;
+        valid = false;
+        outside = false;
+        changedX0 = changedY0 = changedX1 = changedY1 = 0;
+    }
+    
+    // the next Update rasterizes the whole plan again
+    void Invalidate() {
+        valid = false;
+    }
+    
+    void SetMaxCells(int cells) {
+        maxCells = cells;
+        valid = false;
+    }
+    
+    int GetWidth() {
+        return width;
+    }
+    
+    int GetHeight() {
+        return height;
+    }
+    
+    float GetCellSize() {
+        return cellSize;
+    }
+    
+    vec2 GetOrigin() {
+        return origin;
+    }
+    
+    // footprints covering the center of cell x, y
+    int GetCount(int x, int y) {
+        return counts[y * width + x];
+    }
+    
+    // world position of the center of cell x, y
+    vec2 GetCenter(int x, int y) {
+        return vec2(origin.x + (x + 0.5f) * cellSize, origin.y + (y + 0.5f) * cellSize);
+    }
+    
+    // the cells the last Update changed, false if none
+    bool GetChanged(int& x0, int& y0, int& x1, int& y1) {
+        x0 = changedX0; y0 = changedY0;
+        x1 = changedX1; y1 = changedY1;
+        return x0 < x1 && y0 < y1;
+    }
+    
+    // Brings the grid up to date with the scene after UpdateTransforms. The current footprints are
+    // compared with the stamps in parallel; when objects were added or deleted the stamps are
+    // matched to them by object instead. Returns true if the grid was sized and rasterized anew.
+    bool Update(Scene& scene) {
+        if (!valid) {
+            Rebuild(scene);
+            return true;
+        }
+        std::vector<Placement>& placements = scene.GetPlacements();
+        std::vector<Object*> objects = scene.GetObjects();
+        std::vector<Footprint> current;
+        CollectFootprints(placements, objects, current);
+        
+        std::vector<Change> changes;
+        if (placements.size() == placementCount && objects == keys) {
+            const int chunkSize = 4096;
+            std::vector<std::vector<int>> changed((current.size() + chunkSize - 1) / chunkSize);
+            jobs.ParallelFor((int)current.size(), chunkSize, [&](int begin, int end) {
+                for (int i = begin; i < end; i++) {
+                    if (!(current[i] == stamps[i])) changed[begin / chunkSize].push_back(i);
+                }
+            });
+            for (int c = 0; c < changed.size(); c++) {
+                for (int j = 0; j < changed[c].size(); j++) {
+                    int i = changed[c][j];
+                    changes.push_back(MakeChange(stamps[i], -1));
+                    changes.push_back(MakeChange(current[i], 1));
+                }
+            }
+        }
+        else {
+            std::unordered_map<Object*, int> previous;
+            for (int k = 0; k < keys.size(); k++) previous[keys[k]] = placementCount + k;
+            std::vector<bool> matched(stamps.size(), false);
+            for (int i = 0; i < current.size(); i++) {
+                int old = -1;
+                if (i < placements.size()) old = i < placementCount ? i : -1;
+                else {
+                    auto found = previous.find(objects[i - placements.size()]);
+                    if (found != previous.end()) old = found->second;
+                }
+                if (old >= 0) {
+                    matched[old] = true;
+                    if (current[i] == stamps[old]) continue;
+                    changes.push_back(MakeChange(stamps[old], -1));
+                }
+                changes.push_back(MakeChange(current[i], 1));
+            }
+            for (int i = 0; i < stamps.size(); i++) {
+                if (!matched[i]) changes.push_back(MakeChange(stamps[i], -1));
+            }
+            keys = objects;
+            placementCount = (int)placements.size();
+        }
+        stamps.swap(current);
+        if (outside) {
+            Rebuild(scene);
+            return true;
+        }
+        Apply(changes);
+        return false;
+    }
+};
+
+// Occupancy heatmap of the plan: every cell of the occupancy grid shows how much of the area
+// within a meter around it is covered by furniture. Only the cells around the footprints that
+// changed are filtered again and uploaded.
+class DensityMap
+{
+    static const int bandRows = 16;         // rows filtered per job
+    
+    OccupancyGrid grid;
+    float neighbourhood;        // radius of the area the density is measured over in world units
+    int width, height, radius;
+    std::vector<unsigned char> density;     // covered fraction of the neighbourhood, 0-255
+    int dirtyX0, dirtyY0, dirtyX1, dirtyY1; // density cells not uploaded yet
+    
+    DensityOverlayShader* shader;
+    unsigned int texture, vao;
+    int textureWidth, textureHeight;
+    
+    // Recomputes the density of a rectangle of cells as the box filtered counts. Each job keeps the
+    // column sums of the neighbourhood rows and slides a window along them.
+    void Filter(int x0, int y0, int x1, int y1) {
+        x0 = std::max(x0, 0); y0 = std::max(y0, 0);
+        x1 = std::min(x1, width); y1 = std::min(y1, height);
+        if (x0 >= x1 || y0 >= y1) return;
+        int cx0 = std::max(x0 - radius, 0), cx1 = std::min(x1 + radius, width);
+        int area = (2 * radius + 1) * (2 * radius + 1);
+        jobs.ParallelFor(y1 - y0, bandRows, [&](int begin, int end) {
+            std::vector<int> columns(cx1 - cx0, 0);
+            int first = y0 + begin;
+            for (int y = std::max(first - radius, 0); y <= std::min(first + radius, height - 1); y++) {
+                for (int x = cx0; x < cx1; x++) columns[x - cx0] += grid.GetCount(x, y);
+            }
+            for (int y = first; y < y0 + end; y++) {
+                int sum = 0;
+                for (int x = std::max(x0 - radius, 0); x < std::min(x0 + radius, width); x++) sum += columns[x - cx0];
+                for (int x = x0; x < x1; x++) {
+                    if (x + radius < width) sum += columns[x + radius - cx0];
+                    density[y * width + x] = (unsigned char)std::min(sum * 255 / area, 255);
+                    if (x - radius >= 0) sum -= columns[x - radius - cx0];
+                }
+                int leaving = y - radius, entering = y + radius + 1;
+                for (int x = cx0; x < cx1; x++) {
+                    if (leaving >= 0) columns[x - cx0] -= grid.GetCount(x, leaving);
+                    if (entering < height) columns[x - cx0] += grid.GetCount(x, entering);
+                }
+            }
+        });
+        dirtyX0 = std::min(dirtyX0, x0); dirtyY0 = std::min(dirtyY0, y0);
+        dirtyX1 = std::max(dirtyX1, x1); dirtyY1 = std::max(dirtyY1, y1);
+    }
+    
+public:
+    DensityMap() : grid(2048, 1) {
+        neighbourhood = 1;
+        width = height = radius = 0;
+        dirtyX0 = dirtyY0 = dirtyX1 = dirtyY1 = 0;
+        shader = 0;
+        texture = vao = 0;
+        textureWidth = textureHeight = 0;
+    }
+    
+    // the next Update rasterizes the whole plan again
+    void Invalidate() {
+        grid.Invalidate();
+    }
+    
+    int GetWidth() {
+        return width;
+    }
+    
+    int GetHeight() {
+        return height;
+    }
+    
+    // brings the map up to date with the scene after UpdateTransforms
+    void Update(Scene& scene) {
+        int x0, y0, x1, y1;
+        if (grid.Update(scene)) {
+            width = grid.GetWidth();
+            height = grid.GetHeight();
+            radius = (int)ceilf(neighbourhood / grid.GetCellSize());
+            density.assign(width * height, 0);
+            Filter(0, 0, width, height);
+        }
+        else if (grid.GetChanged(x0, y0, x1, y1)) Filter(x0 - radius, y0 - radius, x1 + radius, y1 + radius);
+    }
+    
+    void Initialize() {
+        shader = new DensityOverlayShader();
+        shader->Finish();
+        glGenTextures(1, &texture);
+        glGenVertexArrays(1, &vao);     // core profiles need one bound even without attributes
+    }
+    
+    // uploads the cells that changed since the last frame and blends the map over the plan
+    void Draw() {
+        if (!width) return;
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        if (textureWidth != width || textureHeight != height) {
+            textureWidth = width;
+            textureHeight = height;
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, width, height, 0, GL_RED, GL_UNSIGNED_BYTE, &density[0]);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        }
+        else if (dirtyX0 < dirtyX1 && dirtyY0 < dirtyY1) {
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, dirtyX0, dirtyY0, dirtyX1 - dirtyX0, dirtyY1 - dirtyY0, GL_RED,
+                            GL_UNSIGNED_BYTE, &density[dirtyY0 * width + dirtyX0]);
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        }
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        dirtyX0 = width;
+        dirtyY0 = height;
+        dirtyX1 = dirtyY1 = 0;
+        
+        mat4 V = camera.GetViewTransformationMatrix();
+        vec2 origin = grid.GetOrigin();
+        float size = grid.GetCellSize();
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        shader->Run();
+        shader->UploadDensity(0);
+        shader->UploadBounds(vec4(origin.x, origin.y, origin.x + width * size, origin.y + height * size));
+        shader->UploadView(vec4(V.m[0][0], V.m[1][1], V.m[3][0], V.m[3][1]));
+        glBindVertexArray(vao);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        profiler.CountDraw(4);
+        glDisable(GL_BLEND);
+    }
+};
+
+DensityMap densityMap;
+bool showDensity = false;
+
+// Colors the walking distance to the nearest exit with a contour line every few meters. Cells
+// covered by furniture are left out, and free cells that no exit can be reached from are magenta.
+class EgressOverlayShader : public Shader
+{
+    
+public:
+    EgressOverlayShader() : Shader("egress_overlay")
+    {
+        // vertex shader in GLSL
+        const char *vertexSource = R"(
+#version 410
+        precision highp float;
+        
+        uniform vec4 bounds;           // lower left and upper right corner of the grid in world space
+        uniform vec4 view;             // scale and offset of the camera
+        out vec2 texCoord;
+        
+        void main()
+        {
+            // a quad as a triangle strip, no vertex data needed
+            vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+            texCoord = corner;
+            gl_Position = vec4(mix(bounds.xy, bounds.zw, corner) * view.xy + view.zw, 0, 1);
+        }
+        )";
+        
+        // fragment shader in GLSL
+        const char *fragmentSource = R"(
+#version 410
+        precision highp float;
+        
+        uniform sampler2D distance;
+        uniform float maxDistance;     // distance shown in red
+        uniform float spacing;         // of the contour lines
+        in vec2 texCoord;
+        out vec4 fragmentColor;
+        
+        void main()
+        {
+            float d = texture(distance, texCoord).r;
+            if (d > 1e25) discard;                              // furniture
+            if (d > 1e15) {                                     // no way out
+                fragmentColor = vec4(1, 0, 1, 0.6);
+                return;
+            }
+            vec3 color = mix(vec3(0, 0.8, 0.2), vec3(1, 0.1, 0), clamp(d / maxDistance, 0.0, 1.0));
+            float contour = abs(fract(d / spacing + 0.5) - 0.5) / max(fwidth(d / spacing), 1e-6);
+            fragmentColor = vec4(mix(vec3(1), color, clamp(contour, 0.0, 1.0)), 0.45);
+        }
+        )";
+        
+        Build(vertexSource, fragmentSource, false);
+    }
+    
+    void UploadDistance(int unit) {
+        int location = GetUniformLocation("distance");
+        if (location >= 0) glUniform1i(location, unit);
+        else printf("uniform distance cannot be set\n");
+    }
+    
+    void UploadRange(float maxDistance, float spacing) {
+        int location = GetUniformLocation("maxDistance");
+        if (location >= 0) glUniform1f(location, maxDistance);
+        else printf("uniform maxDistance cannot be set\n");
+        location = GetUniformLocation("spacing");
+        if (location >= 0) glUniform1f(location, spacing);
+        else printf("uniform spacing cannot be set\n");
+    }
+    
+    void UploadBounds(vec4 bounds) {
+        int location = GetUniformLocation("bounds");
+        if (location >= 0) glUniform4f(location, bounds.v[0], bounds.v[1], bounds.v[2], bounds.v[3]);
+        else printf("uniform bounds cannot be set\n");
+    }
+    
+    void UploadView(vec4 view) {
+        int location = GetUniformLocation("view");
+        if (location >= 0) glUniform4f(location, view.v[0], view.v[1], view.v[2], view.v[3]);
+        else printf("uniform view cannot be set\n");
+    }
+};
+
+// Walking distance from every free cell of the occupancy grid to the nearest exit, for
+// evacuation checks. The distances are solved with fast sweeping over an 8-neighbourhood, which
+// never cuts diagonally between two blocked cells, in square tiles on the job system: each wave
+// sweeps the active tiles in parallel against a snapshot of their neighbours' borders, and tiles
+// whose borders got shorter distances activate their neighbours for the next wave. Furniture
+// that moves only activates the tiles around it; cells that got covered take the distances that
+// were routed through them along.
+class EgressField
+{
+    static const int tileSize = 64;
+    static const int ringSize = 4 * tileSize + 4;       // border cells of the neighbours around a tile
+    
+    // cells covered by furniture and free cells without a way out
+    const float blocked = 1e30f;
+    const float unreached = 1e20f;
+    
+    OccupancyGrid grid;
+    float exitRadius;
+    std::vector<vec2> exits;            // in world space, the middle of each side of the grid if empty
+    int width, height, tilesX, tilesY;
+    float step, diagonal;               // of the grid in world units
+    std::vector<float> distances;
+    std::vector<unsigned char> exitCells;
+    std::vector<unsigned char> active;  // per tile, to be swept in the next wave
+    int dirtyX0, dirtyY0, dirtyX1, dirtyY1;     // cells not uploaded yet
+    int waves, sweptTiles;              // of the last solve
+    
+    EgressOverlayShader* shader;
+    unsigned int texture, vao;
+    int textureWidth, textureHeight;
+    
+    void Activate(int x, int y) {
+        active[y / tileSize * tilesX + x / tileSize] = 1;
+    }
+    
+    void MarkDirty(int x0, int y0, int x1, int y1) {
+        dirtyX0 = std::min(dirtyX0, x0); dirtyY0 = std::min(dirtyY0, y0);
+        dirtyX1 = std::max(dirtyX1, x1); dirtyY1 = std::max(dirtyY1, y1);
+    }
+    
+    // distance of a free cell before solving
+    float Seed(int i) {
+        return exitCells[i] ? 0 : unreached;
+    }
+    
+    void MarkExits() {
+        exitCells.assign(width * height, 0);
+        std::vector<vec2> doors = exits;
+        if (doors.empty()) {
+            vec2 lower = grid.GetCenter(0, 0), upper = grid.GetCenter(width - 1, height - 1);
+            vec2 middle((lower.x + upper.x) * 0.5f, (lower.y + upper.y) * 0.5f);
+            doors.push_back(vec2(lower.x, middle.y));
+            doors.push_back(vec2(upper.x, middle.y));
+            doors.push_back(vec2(middle.x, lower.y));
+            doors.push_back(vec2(middle.x, upper.y));
+        }
+        vec2 origin = grid.GetOrigin();
+        float size = grid.GetCellSize();
+        for (int d = 0; d < doors.size(); d++) {
+            int x0 = std::max((int)floorf((doors[d].x - exitRadius - origin.x) / size), 0);
+            int y0 = std::max((int)floorf((doors[d].y - exitRadius - origin.y) / size), 0);
+            int x1 = std::min((int)ceilf((doors[d].x + exitRadius - origin.x) / size) + 1, width);
+            int y1 = std::min((int)ceilf((doors[d].y + exitRadius - origin.y) / size) + 1, height);
+            for (int y = y0; y < y1; y++) {
+                for (int x = x0; x < x1; x++) {
+                    vec2 p = grid.GetCenter(x, y);
+                    float dx = p.x - doors[d].x, dy = p.y - doors[d].y;
+                    if (dx * dx + dy * dy <= exitRadius * exitRadius) exitCells[y * width + x] = 1;
+                }
+            }
+        }
+    }
+    
+    // Sweeps a tile in its padded copy in all four diagonal directions until nothing changes.
+    // Returns the neighbours to activate as bits, counterclockwise from the right one.
+    int SweepTile(int tile, const float* ring, std::vector<float>& local) {
+        int tx = tile % tilesX * tileSize, ty = tile / tilesX * tileSize;
+        int w = std::min(tileSize, width - tx), h = std::min(tileSize, height - ty);
+        int stride = tileSize + 2;
+        local.assign(stride * stride, blocked);
+        for (int y = 0; y < h; y++) memcpy(&local[(y + 1) * stride + 1], &distances[(ty + y) * width + tx], w * sizeof(float));
+        // the ring: bottom and top rows with the corners, then the left and right columns
+        for (int x = 0; x < w + 2; x++) {
+            local[x] = ring[x];
+            local[(h + 1) * stride + x] = ring[tileSize + 2 + x];
+        }
+        for (int y = 0; y < h; y++) {
+            local[(y + 1) * stride] = ring[2 * tileSize + 4 + y];
+            local[(y + 1) * stride + w + 1] = ring[3 * tileSize + 4 + y];
+        }
+        
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (int s = 0; s < 4; s++) {
+                int dx = s & 1 ? -1 : 1, dy = s & 2 ? -1 : 1;
+                for (int j = 0; j < h; j++) {
+                    int y = dy > 0 ? j + 1 : h - j;
+                    for (int k = 0; k < w; k++) {
+                        int x = dx > 0 ? k + 1 : w - k;
+                        float* cell = &local[y * stride + x];
+                        float d = *cell;
+                        if (d >= blocked) continue;
+                        float left = cell[-1], right = cell[1], down = cell[-stride], up = cell[stride];
+                        float best = std::min(std::min(left, right), std::min(down, up)) + step;
+                        // Diagonal moves only where both sides are free. Free neighbours differ by at most
+                        // a step once solved, so clamping the corner to its sides minus a step only
+                        // changes it if a side is blocked, without any branches.
+                        float corners = std::min(std::min(std::max(cell[-stride - 1], std::max(left, down) - step),
+                                                          std::max(cell[-stride + 1], std::max(right, down) - step)),
+                                                 std::min(std::max(cell[stride - 1], std::max(left, up) - step),
+                                                          std::max(cell[stride + 1], std::max(right, up) - step)));
+                        best = std::min(best, corners + diagonal);
+                        if (best < d) {
+                            *cell = best;
+                            changed = true;
+                        }
+                    }
+                }
+            }
+        }
+        
+        // write back and see which borders got closer to an exit
+        int neighbours = 0;
+        for (int y = 0; y < h; y++) {
+            float* row = &distances[(ty + y) * width + tx];
+            const float* updated = &local[(y + 1) * stride + 1];
+            for (int x = 0; x < w; x++) {
+                if (updated[x] >= row[x]) continue;
+                if (x == w - 1) neighbours |= 1;
+                if (y == h - 1) neighbours |= 4;
+                if (x == 0) neighbours |= 16;
+                if (y == 0) neighbours |= 64;
+                if (x == w - 1 && y == h - 1) neighbours |= 2;
+                if (x == 0 && y == h - 1) neighbours |= 8;
+                if (x == 0 && y == 0) neighbours |= 32;
+                if (x == w - 1 && y == 0) neighbours |= 128;
+            }
+            memcpy(row, updated, w * sizeof(float));
+        }
+        return neighbours;
+    }
+    
+    // value of cell x, y for the ring of a neighbouring tile, blocked outside the grid
+    float Ring(int x, int y) {
+        return x < 0 || y < 0 || x >= width || y >= height ? blocked : distances[y * width + x];
+    }
+    
+    // sweeps waves of active tiles until no distance changes any more
+    void Solve() {
+        static const int offsets[8][2] = { { 1, 0 }, { 1, 1 }, { 0, 1 }, { -1, 1 }, { -1, 0 }, { -1, -1 }, { 0, -1 }, { 1, -1 } };
+        std::vector<int> tiles;
+        std::vector<float> rings;
+        std::vector<int> neighbours;
+        waves = sweptTiles = 0;
+        while (true) {
+            tiles.clear();
+            for (int t = 0; t < active.size(); t++) {
+                if (active[t]) tiles.push_back(t);
+            }
+            if (tiles.empty()) break;
+            std::fill(active.begin(), active.end(), 0);
+            waves++;
+            sweptTiles += (int)tiles.size();
+            
+            // snapshot the borders first, the sweeps write them
+            rings.resize(tiles.size() * ringSize);
+            neighbours.assign(tiles.size(), 0);
+            jobs.ParallelFor((int)tiles.size(), 16, [&](int begin, int end) {
+                for (int i = begin; i < end; i++) {
+                    int tx = tiles[i] % tilesX * tileSize, ty = tiles[i] / tilesX * tileSize;
+                    int w = std::min(tileSize, width - tx), h = std::min(tileSize, height - ty);
+                    float* ring = &rings[i * ringSize];
+                    for (int x = 0; x < w + 2; x++) {
+                        ring[x] = Ring(tx + x - 1, ty - 1);
+                        ring[tileSize + 2 + x] = Ring(tx + x - 1, ty + h);
+                    }
+                    for (int y = 0; y < h; y++) {
+                        ring[2 * tileSize + 4 + y] = Ring(tx - 1, ty + y);
+                        ring[3 * tileSize + 4 + y] = Ring(tx + w, ty + y);
+                    }
+                }
+            });
+            jobs.ParallelFor((int)tiles.size(), 1, [&](int begin, int end) {
+                std::vector<float> local;
+                for (int i = begin; i < end; i++) neighbours[i] = SweepTile(tiles[i], &rings[i * ringSize], local);
+            });
+            
+            for (int i = 0; i < tiles.size(); i++) {
+                int tx = tiles[i] % tilesX, ty = tiles[i] / tilesX;
+                MarkDirty(tx * tileSize, ty * tileSize, std::min((tx + 1) * tileSize, width),
+                          std::min((ty + 1) * tileSize, height));
+                for (int k = 0; k < 8; k++) {
+                    int nx = tx + offsets[k][0], ny = ty + offsets[k][1];
+                    if (neighbours[i] >> k & 1 && nx >= 0 && ny >= 0 && nx < tilesX && ny < tilesY)
+                        active[ny * tilesX + nx] = 1;
+                }
+            }
+        }
+    }
+    
+    // seeds every cell and solves from the tiles with exits
+    void Recompute() {
+        width = grid.GetWidth();
+        height = grid.GetHeight();
+        tilesX = (width + tileSize - 1) / tileSize;
+        tilesY = (height + tileSize - 1) / tileSize;
+        step = grid.GetCellSize();
+        diagonal = step * (float)M_SQRT2;
+        MarkExits();
+        distances.resize(width * height);
+        active.assign(tilesX * tilesY, 0);
+        jobs.ParallelFor(height, 16, [&](int begin, int end) {
+            for (int y = begin; y < end; y++) {
+                for (int x = 0; x < width; x++) {
+                    int i = y * width + x;
+                    distances[i] = grid.GetCount(x, y) > 0 ? blocked : Seed(i);
+                }
+            }
+        });
+        for (int i = 0; i < width * height; i++) {
+            if (exitCells[i] && distances[i] == 0) Activate(i % width, i / width);
+        }
+        MarkDirty(0, 0, width, height);
+        Solve();
+    }
+    
+    // drops the distance of a free cell so the sweeps find it again, remembering the old value
+    void Raise(int x, int y, std::vector<std::pair<int, float>>& raised) {
+        int i = y * width + x;
+        raised.push_back(std::make_pair(i, distances[i]));
+        distances[i] = unreached;
+        Activate(x, y);
+        MarkDirty(x, y, x + 1, y + 1);
+    }
+    
+    // Takes the occupancy changes of a rectangle. Newly covered cells invalidate the distances that
+    // were routed through them, found by following the neighbours whose distance they explain, and
+    // uncovered cells are seeded again. Only the tiles of the touched cells are swept.
+    void UpdateRegion(int x0, int y0, int x1, int y1) {
+        std::vector<std::pair<int, float>> raised;
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) {
+                int i = y * width + x;
+                bool covered = grid.GetCount(x, y) > 0;
+                if (covered == (distances[i] >= blocked)) continue;
+                if (covered) {
+                    if (distances[i] < unreached) raised.push_back(std::make_pair(i, distances[i]));
+                    distances[i] = blocked;
+                    // a covered cell also closes the diagonal steps between its neighbours, whose
+                    // distances are not explained by its own, so its whole 3x3 area starts over
+                    for (int ny = std::max(y - 1, 0); ny <= std::min(y + 1, height - 1); ny++) {
+                        for (int nx = std::max(x - 1, 0); nx <= std::min(x + 1, width - 1); nx++) {
+                            int n = ny * width + nx;
+                            if (distances[n] < unreached && !exitCells[n]) Raise(nx, ny, raised);
+                        }
+                    }
+                }
+                else distances[i] = Seed(i);
+                Activate(x, y);
+                MarkDirty(x, y, x + 1, y + 1);
+            }
+        }
+        for (int r = 0; r < raised.size(); r++) {
+            int x = raised[r].first % width, y = raised[r].first / width;
+            float from = raised[r].second;
+            for (int ny = std::max(y - 1, 0); ny <= std::min(y + 1, height - 1); ny++) {
+                for (int nx = std::max(x - 1, 0); nx <= std::min(x + 1, width - 1); nx++) {
+                    int n = ny * width + nx;
+                    float d = distances[n];
+                    if (d >= unreached || exitCells[n]) continue;
+                    float via = from + (nx != x && ny != y ? diagonal : step);
+                    if (d < via - 1e-3f * step) continue;     // reaches an exit some other way
+                    Raise(nx, ny, raised);
+                }
+            }
+        }
+        Solve();
+    }
+    
+public:
+    EgressField() : grid(1024, 2) {
+        exitRadius = 0.5f;
+        width = height = tilesX = tilesY = 0;
+        step = diagonal = 1;
+        dirtyX0 = dirtyY0 = dirtyX1 = dirtyY1 = 0;
+        waves = sweptTiles = 0;
+        shader = 0;
+        texture = vao = 0;
+        textureWidth = textureHeight = 0;
+    }
+    
+    // the grid has at most cells cells per side
+    void SetCells(int cells) {
+        grid.SetMaxCells(cells);
+    }
+    
+    // the next Update solves the whole field again
+    void Invalidate() {
+        grid.Invalidate();
+    }
+    
+    void AddExit(vec2 p) {
+        exits.push_back(p);
+        grid.Invalidate();
+    }
+    
+    void ClearExits() {
+        exits.clear();
+        grid.Invalidate();
+    }
+    
+    int GetWidth() {
+        return width;
+    }
+    
+    int GetHeight() {
+        return height;
+    }
+    
+    int GetWaves() {
+        return waves;
+    }
+    
+    int GetSweptTiles() {
+        return sweptTiles;
+    }
+    
+    // longest walk of a cell that can reach an exit
+    float GetMaxDistance() {
+        float longest = 0;
+        for (int i = 0; i < distances.size(); i++) {
+            if (distances[i] < unreached) longest = fmax(longest, distances[i]);
+        }
+        return longest;
+    }
+    
+    // Solves the whole field again on the current grid and returns the largest difference to the
+    // distances kept up to date incrementally, 0 if they agree. Cells that are reachable in only
+    // one of them count as an infinite difference.
+    float Verify() {
+        if (!width) return 0;
+        std::vector<float> incremental = distances;
+        Recompute();
+        float error = 0;
+        for (int i = 0; i < distances.size(); i++) {
+            if ((incremental[i] >= unreached) != (distances[i] >= unreached)) return INFINITY;
+            if (distances[i] < unreached) error = fmax(error, fabsf(incremental[i] - distances[i]));
+        }
+        return error;
+    }
+    
+    // free cells without a way out
+    int GetTrappedCells() {
+        int trapped = 0;
+        for (int i = 0; i < distances.size(); i++) trapped += distances[i] >= unreached && distances[i] < blocked;
+        return trapped;
+    }
+    
+    // brings the field up to date with the scene after UpdateTransforms, returns true if it was solved anew
+    bool Update(Scene& scene) {
+        int x0, y0, x1, y1;
+        if (grid.Update(scene)) {
+            Recompute();
+            return true;
+        }
+        if (grid.GetChanged(x0, y0, x1, y1)) UpdateRegion(x0, y0, x1, y1);
+        return false;
+    }
+    
+    void Initialize() {
+        shader = new EgressOverlayShader();
+        shader->Finish();
+        glGenTextures(1, &texture);
+        glGenVertexArrays(1, &vao);     // core profiles need one bound even without attributes
+    }
+    
+    // uploads the cells that changed since the last frame and blends the field over the plan
+    void Draw() {
+        if (!width) return;
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        if (textureWidth != width || textureHeight != height) {
+            textureWidth = width;
+            textureHeight = height;
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, width, height, 0, GL_RED, GL_FLOAT, &distances[0]);
+            // the markers for furniture and trapped cells must not be blended with distances
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        }
+        else if (dirtyX0 < dirtyX1 && dirtyY0 < dirtyY1) {
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, dirtyX0, dirtyY0, dirtyX1 - dirtyX0, dirtyY1 - dirtyY0, GL_RED,
+                            GL_FLOAT, &distances[dirtyY0 * width + dirtyX0]);
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        }
+        dirtyX0 = width;
+        dirtyY0 = height;
+        dirtyX1 = dirtyY1 = 0;
+        
+        mat4 V = camera.GetViewTransformationMatrix();
+        vec2 origin = grid.GetOrigin();
+        float size = grid.GetCellSize();
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        shader->Run();
+        shader->UploadDistance(0);
+        shader->UploadRange(30, 5);      // red from 30 m, a contour every 5 m
+        shader->UploadBounds(vec4(origin.x, origin.y, origin.x + width * size, origin.y + height * size));
+        shader->UploadView(vec4(V.m[0][0], V.m[1][1], V.m[3][0], V.m[3][1]));
+        glBindVertexArray(vao);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        profiler.CountDraw(4);
+        glDisable(GL_BLEND);
+    }
+};
+
+EgressField egressField;
+bool showEgress = false;
+
+float snapGridSize = 0.1f;
+bool snapToGrid = false;
+
+// Watches the shader directory on a background thread (inotify on Linux, polling modification
+// times elsewhere) and reads changed sources there. The GL thread only picks up the finished
+// reads, issues the compile next to the running programs and swaps them once the driver is done,
+// so editing a fill pattern never stalls rendering of the plan.
+class ShaderWatcher
+{
+    struct Change
+    {
+        std::string name;
+        std::string vertexSource;
+        std::string fragmentSource;
+    };
+    
+    std::thread thread;
+    std::mutex mutex;
+    std::vector<Change> changes;    // read by the watcher, not yet compiled
+    std::vector<std::string> names;
+    std::atomic<bool> stop;
+    
+    static bool SplitFileName(const std::string& file, std::string& name) {
+        size_t dot = file.rfind('.');
+        if (dot == std::string::npos) return false;
+        std::string extension = file.substr(dot + 1);
+        if (extension != "vert" && extension != "frag") return false;
+        name = file.substr(0, dot);
+        return true;
+    }
+    
+    void Read(const std::string& name) {
+        Change change;
+        change.name = name;
+        if (!ReadTextFile(shaderDirectory + "/" + name + ".vert", change.vertexSource) ||
+            !ReadTextFile(shaderDirectory + "/" + name + ".frag", change.fragmentSource)) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int i = 0; i < changes.size(); i++) {
+            if (changes[i].name == name) {
+                changes[i] = change;
+                return;
+            }
+        }
+        changes.push_back(change);
+    }
+    
+    void Watch() {
+#if defined(__linux__)
+        int fd = inotify_init1(IN_NONBLOCK);
+        if (fd < 0 || inotify_add_watch(fd, shaderDirectory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+            printf("Cannot watch %s\n", shaderDirectory.c_str());
+            if (fd >= 0) close(fd);
+            return;
+        }
+        char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        while (!stop) {
+            struct pollfd request = { fd, POLLIN, 0 };
+            if (poll(&request, 1, 200) <= 0) continue;
+            std::vector<std::string> modified;
+            ssize_t length;
+            while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+                for (char* p = buffer; p < buffer + length; ) {
+                    struct inotify_event* event = (struct inotify_event*)p;
+                    std::string name;
+                    if (event->len && SplitFileName(event->name, name) &&
+                        std::find(modified.begin(), modified.end(), name) == modified.end())
+                        modified.push_back(name);
+                    p += sizeof(struct inotify_event) + event->len;
+                }
+            }
+            for (int i = 0; i < modified.size(); i++) Read(modified[i]);
+        }
+        close(fd);
+#else
+        std::vector<long long> times(names.size(), 0);
+        for (bool first = true; !stop; first = false) {
+            for (int i = 0; i < names.size(); i++) {
+                long long time = 0;
+                struct stat info;
+                if (stat((shaderDirectory + "/" + names[i] + ".vert").c_str(), &info) == 0) time += info.st_mtime;
+                if (stat((shaderDirectory + "/" + names[i] + ".frag").c_str(), &info) == 0) time += info.st_mtime;
+                if (!first && time != times[i]) Read(names[i]);
+                times[i] = time;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(250));
+        }
+#endif
+    }
+    
+public:
+    ShaderWatcher() : stop(false) {}
+    
+    ~ShaderWatcher() {
+        Stop();
+    }
+    
+    void Start() {
+        for (int i = 0; i < shaderRegistry.size(); i++) {
+            if (shaderRegistry[i]->GetName()) names.push_back(shaderRegistry[i]->GetName());
+        }
+        thread = std::thread(&ShaderWatcher::Watch, this);
+    }
+    
+    void Stop() {
+        stop = true;
+        if (thread.joinable()) thread.join();
+    }
+    
+    // called on the GL thread: starts compiling new sources and swaps in programs that are done
+    void Update() {
+        std::vector<Change> ready;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (int i = 0; i < changes.size(); ) {
+                Shader* shader = FindShader(changes[i].name);
+                // a shader that is still compiling gets the newer sources once it is done
+                if (shader && shader->IsReloading()) {
+                    i++;
+                    continue;
+                }
+                if (shader) ready.push_back(changes[i]);
+                changes.erase(changes.begin() + i);
+            }
+        }
+        for (int i = 0; i < ready.size(); i++) {
+            FindShader(ready[i].name)->Reload(ready[i].vertexSource, ready[i].fragmentSource);
+        }
+        
+        for (int i = 0; i < shaderRegistry.size(); i++) {
+            Shader* shader = shaderRegistry[i];
+            if (!shader->IsReloading() || !shader->IsReady()) continue;
+            if (shader->FinishReload()) {
+                printf("Reloaded shader %s\n", shader->GetName());
+                scheduler.Invalidate();
+            }
+            else printf("Shader %s has errors, keeping the previous version\n", shader->GetName());
+        }
+    }
+    
+    static Shader* FindShader(const std::string& name) {
+        for (int i = 0; i < shaderRegistry.size(); i++) {
+            if (shaderRegistry[i]->GetName() && name == shaderRegistry[i]->GetName()) return shaderRegistry[i];
+        }
+        return NULL;
+    }
+};
+
+ShaderWatcher shaderWatcher;
+
+// polls the shader watcher a few times per second, also while the frame scheduler sleeps
+void onShaderTimer(int value) {
+    shaderWatcher.Update();
+    glutTimerFunc(100, onShaderTimer, 0);
+}
+
+// Offscreen framebuffer, used when rendering without a visible window and for multisampling.
+// A multisampled target has to be resolved into a single sampled one before it can be shown.
+class RenderTarget
+{
+    unsigned int framebuffer, color, depth;
+    int width, height, samples;
+    
+public:
+    RenderTarget(int width, int height, int requestedSamples = 0) : width(width), height(height)
+    {
+        int maxSamples = 0;
+        glGetIntegerv(GL_MAX_SAMPLES, &maxSamples);
+        samples = (int)fmax(fmin(requestedSamples, maxSamples), 0);
+        
+        glGenFramebuffers(1, &framebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        
+        glGenRenderbuffers(1, &color);
+        glBindRenderbuffer(GL_RENDERBUFFER, color);
+        glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_RGBA8, width, height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color);
+        
+        glGenRenderbuffers(1, &depth);
+        glBindRenderbuffer(GL_RENDERBUFFER, depth);
+        glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_DEPTH_COMPONENT24, width, height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+        
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            printf("Offscreen framebuffer is incomplete\n");
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+    
+    ~RenderTarget() {
+        glDeleteFramebuffers(1, &framebuffer);
+        glDeleteRenderbuffers(1, &color);
+        glDeleteRenderbuffers(1, &depth);
+    }
+    
+    void Bind() {
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glViewport(0, 0, width, height);
+    }
+    
+    void Unbind() {
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, windowWidth, windowHeight);
+    }
+    
+    // averages the samples into another framebuffer of the same size, 0 is the window, and leaves
+    // that one bound
+    void Resolve(unsigned int target) {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target);
+        glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, target);
+    }
+    
+    unsigned int GetFramebuffer() {
+        return framebuffer;
+    }
+    
+    // the sample count the driver supports, 0 if not multisampled
+    int GetSamples() {
+        return samples;
+    }
+};
+
+int msaaSamples = 0;
+RenderTarget* sceneTarget = 0;     // multisampled scene in the window, 0 renders directly
+
+bool persistentBuffers = true;
+
+const char* cellFile = 0;      // venue paged from disk, generated first if expoItems is set
+int expoItems = 0;
+int pageBudget = 64;           // megabytes of resident cells
+
+// Appends every input event with the time it arrived to a text file (--record), so that a session
+// can be played back with --replay. A line per event:
+//   time mouse button state x y modifiers
+//   time motion x y
+//   time key|keyup code x y
+// Lines are flushed right away, a crash still leaves the events that led to it.
+class InputRecorder
+{
+    FILE* file = 0;
+    
+public:
+    bool Open(const char* filename) {
+        file = fopen(filename, "w");
+        if (!file) { printf("Cannot write %s\n", filename); return false; }
+        fprintf(file, "# eventplanner input v1 %d %d\n", windowWidth, windowHeight);
+        fflush(file);
+        return true;
+    }
+    
+    void Close() {
+        if (file) fclose(file);
+        file = 0;
+    }
+    
+    void Mouse(int button, int state, int x, int y, int modifiers) {
+        if (!file) return;
+        fprintf(file, "%.6f mouse %d %d %d %d %d\n", GetElapsedTime(), button, state, x, y, modifiers);
+        fflush(file);
+    }
+    
+    void Motion(int x, int y) {
+        if (!file) return;
+        fprintf(file, "%.6f motion %d %d\n", GetElapsedTime(), x, y);
+        fflush(file);
+    }
+    
+    void Key(unsigned char key, bool down, int x, int y) {
+        if (!file) return;
+        fprintf(file, "%.6f %s %d %d %d\n", GetElapsedTime(), down ? "key" : "keyup", key, x, y);
+        fflush(file);
+    }
+};
+
+InputRecorder inputRecorder;
+int replayModifiers = 0;        // modifier keys of the mouse event being replayed
+
+// modifier keys held during the current mouse event
+int GetModifiers() {
+    if (virtualClock >= 0) return replayModifiers;
+    return glutGetModifiers();
+}
+
+// initialization, create an OpenGL context
+void onInitialization()
+{
+    glViewport(0, 0, windowWidth, windowHeight);
+    
+    shaderCache.Initialize();
+    EnableParallelShaderCompile();
+    frameUniforms.Initialize();
+    
+    gScene = new Scene();
+    gScene->Initialize();
+    
+    profiler.Initialize();
+    profilerOverlay.Initialize();
+    guideOverlay.Initialize(profilerOverlay.GetShader());
+    instanceBatches.stream.Initialize(persistentBuffers);
+    selectionOutline.Initialize(windowWidth, windowHeight, persistentBuffers);
+    densityMap.Initialize();
+    egressField.Initialize();
+    if (msaaSamples > 0) {
+        sceneTarget = new RenderTarget(windowWidth, windowHeight, msaaSamples);
+        printf("Rendering with %dx MSAA\n", sceneTarget->GetSamples());
+    }
+    
+    if (cellFile) {
+        if (expoItems > 0) CellPager::WriteExpo(cellFile, *gScene, expoItems);
+        if (cellPager.Open(cellFile, *gScene, (size_t)pageBudget << 20)) {
+            vec2 start = cellPager.GetStart();
+            camera.Set(vec2(start.x / 10, start.y / 10), 10);
+        }
+    }
+}
+
+void onExit()
+{
+    inputRecorder.Close();
+    cellPager.Close();
+    delete sceneTarget;
+    delete gScene;
+    printf("exit");
+}
+
+void ApplyDrag();
+
+// brings the scene and the overlays up to date with the input that arrived since the last frame
+void UpdateFrame() {
+    profiler.Begin(SectionUpdate);
+    profiler.TakeInput();
+    ApplyDrag();
+    gScene->UpdateTransforms();
+    cellPager.Update(camera);
+    if (showDensity) densityMap.Update(*gScene);
+    if (showEgress && egressField.Update(*gScene)) {
+        printf("Egress: %dx%d cells, longest walk %.1f m, %d trapped cells, %d waves\n", egressField.GetWidth(),
+               egressField.GetHeight(), egressField.GetMaxDistance(), egressField.GetTrappedCells(), egressField.GetWaves());
+    }
+    profiler.End(SectionUpdate);
+}
+
+// window has become invalid: redraw
+void onDisplay()
+{
+    static bool firstFrame = true;
+    if (firstFrame) {
+        printf("Startup: %.1f ms to the first frame\n", profiler.Now() * 1000);
+        firstFrame = false;
+    }
+    
+    profiler.Begin(SectionFrame);
+    profiler.BeginGpuFrame();
+    frameUniforms.Update((float)GetElapsedTime());
+    
+    if (sceneTarget) sceneTarget->Bind();
+    glClearColor(0, 0, 0, 0); // background color
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // clear the screen
+    
+    UpdateFrame();
+    
+    cellPager.Draw(camera);          // the paged venue lies below the plan
+    gScene->DrawInstanced(instanceBatches);
+    if (sceneTarget) sceneTarget->Resolve(0);     // overlays are drawn single sampled
+    
+    profiler.Begin(SectionOverlay);
+    if (showDensity) densityMap.Draw();
+    if (showEgress) egressField.Draw();
+    selectionOutline.Draw(*gScene);
+    guideOverlay.Draw(gScene->GetGuides());
+    profilerOverlay.Draw();
+    profiler.End(SectionOverlay);
+    
+    profiler.EndGpuFrame();
+    profiler.Begin(SectionSwap);
+    glutSwapBuffers(); // exchange the two buffers
+    profiler.End(SectionSwap);
+    
+    profiler.End(SectionFrame);
+    profiler.EndFrame();
+}
+
+vec2 mouseStartLocation;
+vec2 lastClick;         // where the last press was, for placing exits
+vec2 offset;
+
+// Motion events only record the latest mouse position, the drag is applied to the selection once
+// per frame. High rate mice deliver several events per frame that would otherwise each move,
+// snap and collision check the whole selection.
+bool dragPending = false;
+int dragX, dragY;
+
+// window pixel to world coordinates
+vec2 WindowToWorld(int x, int y) {
+    // normalize
+    float cx = (float)x / (float)windowWidth;
+    float cy = (float)y / (float)windowHeight;
+    
+    // convert to coordinates
+    cx = (cx-0.5)/0.5;
+    cy = -(cy-0.5)/0.5;
+    
+    return camera.ScreenToWorld(vec2(cx, cy));
+}
+
+// moves the selection to the latest coalesced drag position
+void ApplyDrag() {
+    if (!dragPending) return;
+    dragPending = false;
+    
+    vec2 p = WindowToWorld(dragX, dragY);
+    offset = vec2(p.x-mouseStartLocation.x, p.y-mouseStartLocation.y);
+    
+    // snap within 8 pixels
+    float tolerance = 16.0f / windowWidth * (camera.ScreenToWorld(vec2(1, 0)).x - camera.ScreenToWorld(vec2(0, 0)).x);
+    offset = gScene->SnapDrag(offset, tolerance, snapToGrid ? snapGridSize : 0);
+    
+    gScene->MoveSelection(offset);
+    gScene->CheckDrag();      // overlapping furniture turns red
+}
+
+void onMouse(int button, int state, int x, int y) {
+    inputRecorder.Mouse(button, state, x, y, GetModifiers());
+    profiler.CountInput();
+    
+    if (state == GLUT_DOWN) {
+        dragPending = false;
+        mouseStartLocation = WindowToWorld(x, y);
+        lastClick = mouseStartLocation;
+        
+        float threshold = 0.3;
+        // shift picks a single piece out of a group, like a chair of a table setting
+        gScene->Select(gScene->Pick(mouseStartLocation, threshold), (GetModifiers() & GLUT_ACTIVE_SHIFT) != 0);
+        gScene->BeginDrag();
+    }
+    else if (state == GLUT_UP) {
+        ApplyDrag();            // motion that arrived since the last frame
+        gScene->DropSelection(offset);
+        gScene->EndDrag();
+        mouseStartLocation = vec2(0,0);
+        offset = vec2(0,0);
+    }
+    scheduler.Invalidate();
+}
+
+void onMouseDrag(int x, int y) {
+    inputRecorder.Motion(x, y);
+    profiler.CountInput();
+    dragX = x;
+    dragY = y;
+    dragPending = true;
+    scheduler.Invalidate();
+}
+
+void onKeyboardUp(unsigned char key, int i, int j) {
+    inputRecorder.Key(key, false, i, j);
+    
+    if (keyboardState[127]) gScene->DeleteSelected();
+    
+    keyboardState[key] = false;
+    scheduler.Invalidate();
+}
+
+void onKeyboard(unsigned char key, int i, int j) {
+    inputRecorder.Key(key, true, i, j);
+    keyboardState[key] = true;
+    
+    if (key == 'o') {
+        profilerOverlay.Toggle();
+        scheduler.Invalidate();
+    }
+    if (key >= '1' && key <= '3') {
+        LayoutKind kinds[3] = { LayoutRows, LayoutGrid, LayoutBanquet };
+        const int count = 2000;
+        double start = profiler.Now();
+        int placed = gScene->AddLayout(kinds[key - '1'], camera.ScreenToWorld(vec2(0, 0)), count);
+        printf("Placed %d of %d items in %.2f ms\n", placed, count, (profiler.Now() - start) * 1000);
+        scheduler.Invalidate();
+    }
+    if (key == 'm') {
+        analyticCoverage = !analyticCoverage;
+        printf("Analytic coverage anti-aliasing %s\n", analyticCoverage ? "on" : "off");
+        scheduler.Invalidate();
+    }
+    if (key == 's') {
+        scrollStripes = !scrollStripes;
+        printf("Stripe scrolling %s\n", scrollStripes ? "on" : "off");
+        scheduler.Invalidate();
+    }
+    if (key == 'g') {
+        snapToGrid = !snapToGrid;
+        printf("Grid snapping %s\n", snapToGrid ? "on" : "off");
+    }
+    if (key == 'v') {
+        double start = profiler.Now();
+        int conflicts = gScene->ValidateLayout();
+        printf("%d overlapping items (%.2f ms)\n", conflicts, (profiler.Now() - start) * 1000);
+        scheduler.Invalidate();
+    }
+    if (key == '0') {
+        gScene->ClearLayouts();
+        scheduler.Invalidate();
+    }
+    if (key == 'b') {
+        gScene->AddTableSetting(camera.ScreenToWorld(vec2(0, 0)), 8);
+        scheduler.Invalidate();
+    }
+    if (key == 'p') {
+        if (profiler.ExportCSV("profile.csv") && profiler.ExportTrace("profile_trace.json"))
+            printf("Wrote profile.csv and profile_trace.json\n");
+    }
+    if (key == 'h') {
+        showDensity = !showDensity;
+        densityMap.Invalidate();
+        printf("Density heatmap %s\n", showDensity ? "on" : "off");
+        scheduler.Invalidate();
+    }
+    if (key == 'f') {
+        showEgress = !showEgress;
+        egressField.Invalidate();
+        printf("Egress distances %s\n", showEgress ? "on" : "off");
+        scheduler.Invalidate();
+    }
+    if (key == 'n') {
+        egressField.AddExit(lastClick);
+        printf("Exit added at %.2f, %.2f\n", lastClick.x, lastClick.y);
+        scheduler.Invalidate();
+    }
+    if (key == 'e') {
+        double start = profiler.Now();
+        long long size = gScene->ExportSvg("plan.svg", (float)GetElapsedTime());
+        if (size >= 0) printf("Wrote plan.svg (%lld kB) in %.1f ms\n", size / 1024, (profiler.Now() - start) * 1000);
+    }
+    scheduler.Wake();
+}
+
+// true while held keys keep changing the scene or paged cells are on their way
+bool isSimulating() {
+    return camera.IsMoving() || keyboardState['a'] || keyboardState['d'] || cellPager.IsLoading();
+}
+
+// advance the simulation by one fixed time step, returns true if anything visible changed
+bool onUpdate(double dt) {
+    bool changed = camera.Move(dt);
+    
+    if (keyboardState['a'] || keyboardState['d']) {
+        double angle = (keyboardState['a'] ? dt : 0) - (keyboardState['d'] ? dt : 0);
+        gScene->RotateSelection(angle);
+        if (!gScene->GetSelection().empty()) changed = true;
+    }
+    return changed || cellPager.HasArrivals();
+}
+
+void onIdle( ) {
+    scheduler.Tick(onUpdate, isSimulating);
+}
+
+struct BenchmarkOptions
+{
+    int objects;
+    int frames;
+    unsigned int seed;
+    const char* output;
+};
+
+// a way of rendering the scene that the benchmark compares against the others
+struct BenchmarkConfig
+{
+    const char* name;
+    void (*draw)();
+    int threads;        // size of the job system while running this configuration
+    int samples;        // MSAA samples of the render target, resolved every frame
+    bool analytic;      // analytic coverage anti-aliasing
+};
+
+void drawSceneImmediate() {
+    gScene->Draw();
+}
+
+void drawSceneCommandList() {
+    profiler.Begin(SectionCull);
+    gScene->BuildCommandList(commandList);
+    profiler.End(SectionCull);
+    profiler.Begin(SectionDraw);
+    commandList.Submit();
+    profiler.End(SectionDraw);
+}
+
+void drawSceneInstanced() {
+    gScene->DrawInstanced(instanceBatches);
+}
+
+BenchmarkConfig benchmarkConfigs[] = {
+    { "scene_draw", drawSceneImmediate, 1, 0, false },
+    { "command_list", drawSceneCommandList, 1, 0, false },
+    { "command_list", drawSceneCommandList, 2, 0, false },
+    { "command_list", drawSceneCommandList, 4, 0, false },
+    { "command_list", drawSceneCommandList, 8, 0, false },
+    { "instanced_stream", drawSceneInstanced, 1, 0, false },
+    { "instanced_stream", drawSceneInstanced, 2, 0, false },
+    { "instanced_stream", drawSceneInstanced, 4, 0, false },
+    { "instanced_stream", drawSceneInstanced, 8, 0, false },
+    { "instanced_msaa", drawSceneInstanced, 4, 2, false },
+    { "instanced_msaa", drawSceneInstanced, 4, 4, false },
+    { "instanced_msaa", drawSceneInstanced, 4, 8, false },
+    { "instanced_analytic_aa", drawSceneInstanced, 4, 0, true },
+};
+
+// peak resident set size of the process in kilobytes
+long peakMemoryKB() {
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+    return 0;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss / 1024;  // bytes on macOS
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+// text as a JSON string literal, with quotes, backslashes and control characters escaped
+std::string JsonString(const char* text) {
+    std::string json = "\"";
+    for (const char* c = text ? text : ""; *c; c++) {
+        if (*c == '"' || *c == '\\') json += '\\';
+        if ((unsigned char)*c < 0x20) json += Format("\\u%04x", *c);
+        else json += *c;
+    }
+    return json + "\"";
+}
+
+// writes "name":{...} with mean and percentiles of the values multiplied by unit
+void writeBenchmarkStats(FILE* file, const char* name, std::vector<double> values, double unit) {
+    if (values.empty()) {
+        fprintf(file, "\"%s\":null", name);
+        return;
+    }
+    double sum = 0;
+    for (int i = 0; i < values.size(); i++) sum += values[i];
+    std::sort(values.begin(), values.end());
+    size_t last = values.size() - 1;
+    fprintf(file, "\"%s\":{\"mean\":%.4f,\"p50\":%.4f,\"p95\":%.4f,\"p99\":%.4f,\"max\":%.4f}", name,
+            sum / values.size() * unit, values[last * 50 / 100] * unit, values[last * 95 / 100] * unit,
+            values[last * 99 / 100] * unit, values[last] * unit);
+}
+
+// scripted camera path: one circle around the venue while zooming out to the whole plan and back in
+void benchmarkCamera(int frame, int frames, float extent) {
+    float t = (float)frame / frames;
+    float size = 1.5f + (fmax(extent, 1.5f) - 1.5f) * 0.5f * (1 - cosf(2 * M_PI * t));
+    vec2 target(extent * 0.5f * sinf(2 * M_PI * t), extent * 0.5f * cosf(2 * M_PI * t));
+    camera.Set(vec2(target.x / size, target.y / size), size);
+}
+
+// Renders a procedurally generated venue offscreen with every benchmark configuration, following
+// the same scripted camera path and selections, and writes the measurements as JSON.
+int runBenchmark(BenchmarkOptions options) {
+    const int warmupFrames = 10;
+    if (options.frames < 1) options.frames = 1;
+    long memoryBefore = peakMemoryKB();
+    
+    shaderCache.Initialize();
+    EnableParallelShaderCompile();
+    frameUniforms.Initialize();
+    
+    double loadStart = profiler.Now();
+    gScene = new Scene();
+    gScene->GenerateVenue(options.objects, options.seed);
+    double loadTime = profiler.Now() - loadStart;
+    long sceneMemory = peakMemoryKB() - memoryBefore;
+    
+    profiler.Initialize();
+    instanceBatches.stream.Initialize(persistentBuffers);
+    selectionOutline.Initialize(windowWidth, windowHeight, persistentBuffers);
+    RenderTarget target(windowWidth, windowHeight);
+    float extent = (float)ceil(sqrt((double)options.objects)) * 0.25f * 0.5f;
+    
+    // layout generation next to the venue, without adding the placements to it
+    const int layoutCount = 100000;
+    const char* layoutNames[3] = { "rows", "grid", "banquet" };
+    double layoutTimes[3];
+    int layoutPlaced[3];
+    for (int k = 0; k < 3; k++) {
+        std::vector<Placement> layout;
+        double start = profiler.Now();
+        layoutPlaced[k] = gScene->GenerateLayout((LayoutKind)k, vec2(extent + 150, 0), layoutCount, layout);
+        layoutTimes[k] = profiler.Now() - start;
+    }
+    
+    // a second layout at the same center has to fit around the first, nothing may land on top of it
+    int restackOverlaps = 0;
+    for (int k = 0; k < 3; k++) {
+        std::vector<Placement>& placements = gScene->GetPlacements();
+        int before = (int)placements.size();
+        gScene->AddLayout((LayoutKind)k, vec2(extent + 150, 0), layoutCount);
+        vec2 min(1e30f, 1e30f), max(-1e30f, -1e30f);
+        for (int i = before; i < placements.size(); i++) {
+            min = vec2(fmin(min.x, placements[i].position.x), fmin(min.y, placements[i].position.y));
+            max = vec2(fmax(max.x, placements[i].position.x), fmax(max.y, placements[i].position.y));
+        }
+        SpatialGrid first;
+        first.Reset(min, max, 0.3f);
+        for (int i = before; i < placements.size(); i++) first.Insert(placements[i].position, placements[i].radius);
+        std::vector<Placement> second;
+        gScene->GenerateLayout((LayoutKind)k, vec2(extent + 150, 0), layoutCount, second);
+        for (int i = 0; i < second.size(); i++) restackOverlaps += first.Overlaps(second[i].position, second[i].radius, 0);
+        placements.erase(placements.begin() + before, placements.end());
+    }
+    if (restackOverlaps) printf("%d items of a second layout overlap the first\n", restackOverlaps);
+    
+    // drag an object across its neighbours, then validate the whole venue on all threads
+    jobs.Start(0);
+    std::vector<double> dragTimes, snapTimes;
+    if (!gScene->GetObjects().empty()) {
+        gScene->Select(0);
+        gScene->BeginDrag();
+        for (int i = 0; i < 100; i++) {
+            double start = profiler.Now();
+            vec2 offset = gScene->SnapDrag(vec2(i * 0.01f, i * 0.003f), 0.01f, 0.1f);
+            snapTimes.push_back(profiler.Now() - start);
+            gScene->MoveSelection(offset);
+            start = profiler.Now();
+            gScene->CheckDrag();
+            dragTimes.push_back(profiler.Now() - start);
+        }
+        gScene->MoveSelection(vec2(0, 0));
+        gScene->EndDrag();
+        gScene->Select(-1);
+    }
+    double validateStart = profiler.Now();
+    int overlaps = gScene->ValidateLayout();
+    double validateTime = profiler.Now() - validateStart;
+    gScene->ClearConflicts();
+    
+    // the whole density map, then its incremental updates while an object is dragged
+    densityMap.Invalidate();
+    double densityStart = profiler.Now();
+    densityMap.Update(*gScene);
+    double densityTime = profiler.Now() - densityStart;
+    
+    // egress distances on a 4096 cell grid, the same way
+    EgressField* egress = new EgressField();
+    egress->SetCells(4096);
+    double egressStart = profiler.Now();
+    egress->Update(*gScene);
+    double egressTime = profiler.Now() - egressStart;
+    std::vector<double> densityTimes, egressTimes;
+    if (!gScene->GetObjects().empty()) {
+        gScene->Select(0);
+        gScene->BeginDrag();
+        for (int i = 0; i < 100; i++) {
+            gScene->MoveSelection(vec2(i * 0.01f, i * 0.003f));
+            gScene->UpdateTransforms();
+            double start = profiler.Now();
+            densityMap.Update(*gScene);
+            densityTimes.push_back(profiler.Now() - start);
+            start = profiler.Now();
+            egress->Update(*gScene);
+            egressTimes.push_back(profiler.Now() - start);
+        }
+        gScene->MoveSelection(vec2(0, 0));
+        gScene->EndDrag();
+        gScene->Select(-1);
+    }
+    // the incremental updates must end where a full solve of the same grid ends
+    float egressError = egress->Verify();
+    if (egressError > 0) printf("Egress updates differ from a full solve by up to %g m\n", egressError);
+    if (isinf(egressError)) egressError = -1;       // a cell reachable in only one of them
+    
+    FILE* file = fopen(options.output, "w");
+    if (!file) { printf("Cannot write %s\n", options.output); return 1; }
+    fprintf(file, "{\"objects\":%d,\"frames\":%d,\"seed\":%u,\"renderer\":%s,\"persistent_buffers\":%s,"
+            "\"load_ms\":%.3f,\"scene_memory_kb\":%ld,\"scene_allocations\":%zu,\"arena_blocks\":%d,\"arena_kb\":%zu,",
+            options.objects, options.frames, options.seed, JsonString((const char*)glGetString(GL_RENDERER)).c_str(),
+            instanceBatches.stream.IsPersistent() ? "true" : "false", loadTime * 1000, sceneMemory,
+            gScene->GetArena().allocations, gScene->GetArena().GetBlockCount(), gScene->GetArena().bytes / 1024);
+    fprintf(file, "\"layouts\":[");
+    for (int k = 0; k < 3; k++) {
+        fprintf(file, "%s{\"kind\":\"%s\",\"requested\":%d,\"placed\":%d,\"ms\":%.3f}", k ? "," : "",
+                layoutNames[k], layoutCount, layoutPlaced[k], layoutTimes[k] * 1000);
+    }
+    fprintf(file, "],\"layout_restack_overlaps\":%d,", restackOverlaps);
+    writeBenchmarkStats(file, "drag_check_us", dragTimes, 1e6);
+    fprintf(file, ",");
+    writeBenchmarkStats(file, "snap_us", snapTimes, 1e6);
+    fprintf(file, ",\"validate_ms\":%.3f,\"overlaps\":%d,\"density_rebuild_ms\":%.3f,", validateTime * 1000, overlaps,
+            densityTime * 1000);
+    writeBenchmarkStats(file, "density_update_us", densityTimes, 1e6);
+    fprintf(file, ",\"egress_grid\":[%d,%d],\"egress_solve_ms\":%.3f,\"egress_max_error\":%g,", egress->GetWidth(),
+            egress->GetHeight(), egressTime * 1000, egressError);
+    writeBenchmarkStats(file, "egress_update_ms", egressTimes, 1000);
+    delete egress;
+    fprintf(file, ",\"configs\":[\n");
+    
+    int configCount = sizeof(benchmarkConfigs) / sizeof(benchmarkConfigs[0]);
+    for (int c = 0; c < configCount; c++) {
+        std::mt19937 rng(options.seed);
+        std::vector<double> frameTimes, gpuTimes, pickTimes, transformTimes;
+        double drawCalls = 0, stateChanges = 0, vertices = 0;
+        std::vector<double> buildTimes;
+        
+        jobs.Start(benchmarkConfigs[c].threads);
+        RenderTarget* multisampled = 0;
+        if (benchmarkConfigs[c].samples > 0)
+            multisampled = new RenderTarget(windowWidth, windowHeight, benchmarkConfigs[c].samples);
+        analyticCoverage = benchmarkConfigs[c].analytic;
+        for (int f = -warmupFrames; f < options.frames; f++) {
+            benchmarkCamera(f < 0 ? 0 : f, options.frames, extent);
+            
+            // click on a random object every tenth frame
+            double pickTime = -1;
+            std::vector<Object*> objects = gScene->GetObjects();
+            if (f % 10 == 0 && !objects.empty()) {
+                vec2 p = objects[rng() % objects.size()]->GetPosition();
+                double pickStart = profiler.Now();
+                gScene->Select(gScene->Pick(p, 0.3f));
+                pickTime = profiler.Now() - pickStart;
+            }
+            
+            // drag the selection around, so only its group has to be propagated
+            gScene->MoveSelection(vec2(0.05f * sinf(f * 0.1f), 0));
+            double transformStart = profiler.Now();
+            gScene->UpdateTransforms();
+            double transformTime = profiler.Now() - transformStart;
+            
+            profiler.Begin(SectionFrame);
+            profiler.BeginGpuFrame();
+            frameUniforms.Update(f / 60.0f);     // animations advance at 60 Hz, independent of the frame time
+            if (multisampled) multisampled->Bind();
+            else target.Bind();
+            glClearColor(0, 0, 0, 0);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            benchmarkConfigs[c].draw();
+            if (multisampled) multisampled->Resolve(target.GetFramebuffer());
+            selectionOutline.Draw(*gScene);
+            profiler.EndGpuFrame();
+            profiler.Begin(SectionSwap);
+            glFinish();
+            profiler.End(SectionSwap);
+            profiler.End(SectionFrame);
+            profiler.EndFrame();
+            
+            if (f < 0) continue;
+            FrameRecord& record = profiler.GetFrame(profiler.GetFrameCount() - 1);
+            frameTimes.push_back(record.duration[SectionFrame]);
+            buildTimes.push_back(record.duration[SectionCull]);
+            if (record.gpuTime >= 0) gpuTimes.push_back(record.gpuTime);
+            if (pickTime >= 0) pickTimes.push_back(pickTime);
+            transformTimes.push_back(transformTime);
+            drawCalls += record.drawCalls;
+            stateChanges += record.stateChanges;
+            vertices += record.vertices;
+        }
+        target.Unbind();
+        int samples = multisampled ? multisampled->GetSamples() : 0;
+        delete multisampled;
+        analyticCoverage = false;
+        
+        fprintf(file, "%s{\"name\":\"%s\",\"threads\":%d,\"samples\":%d,\"analytic_aa\":%s,", c ? ",\n" : "",
+                benchmarkConfigs[c].name, benchmarkConfigs[c].threads, samples,
+                benchmarkConfigs[c].analytic ? "true" : "false");
+        writeBenchmarkStats(file, "frame_ms", frameTimes, 1000);
+        fprintf(file, ",");
+        writeBenchmarkStats(file, "cull_build_ms", buildTimes, 1000);
+        fprintf(file, ",");
+        writeBenchmarkStats(file, "gpu_ms", gpuTimes, 1000);
+        fprintf(file, ",");
+        writeBenchmarkStats(file, "pick_us", pickTimes, 1e6);
+        fprintf(file, ",");
+        writeBenchmarkStats(file, "transform_us", transformTimes, 1e6);
+        fprintf(file, ",\"draw_calls\":%.1f,\"state_changes\":%.1f,\"vertices\":%.1f,\"peak_memory_kb\":%ld}",
+                drawCalls / options.frames, stateChanges / options.frames, vertices / options.frames, peakMemoryKB());
+        
+        std::sort(frameTimes.begin(), frameTimes.end());
+        printf("%-21s %d threads, %d samples: frame p50 %.3f ms, p95 %.3f ms\n", benchmarkConfigs[c].name,
+               benchmarkConfigs[c].threads, samples, frameTimes[frameTimes.size() / 2] * 1000, frameTimes[(frameTimes.size() - 1) * 95 / 100] * 1000);
+    }
+    
+    // the software rasterizer along the same camera path
+    SoftwareRenderer renderer(windowWidth, windowHeight);
+    gScene->Select(-1);
+    fprintf(file, "\n],\"software\":[\n");
+    const int softwareThreads[4] = { 1, 2, 4, 8 };
+    for (int t = 0; t < 4; t++) {
+        jobs.Start(softwareThreads[t]);
+        std::vector<double> frameTimes;
+        for (int f = -warmupFrames; f < options.frames; f++) {
+            benchmarkCamera(f < 0 ? 0 : f, options.frames, extent);
+            gScene->UpdateTransforms();
+            double start = profiler.Now();
+            gScene->DrawSoftware(renderer, f / 60.0f);
+            if (f >= 0) frameTimes.push_back(profiler.Now() - start);
+        }
+        fprintf(file, "%s{\"threads\":%d,", t ? ",\n" : "", softwareThreads[t]);
+        writeBenchmarkStats(file, "frame_ms", frameTimes, 1000);
+        fprintf(file, "}");
+        
+        std::sort(frameTimes.begin(), frameTimes.end());
+        printf("%-21s %d threads: frame p50 %.3f ms, p95 %.3f ms\n", "software", softwareThreads[t],
+               frameTimes[frameTimes.size() / 2] * 1000, frameTimes[(frameTimes.size() - 1) * 95 / 100] * 1000);
+    }
+    
+    // Compares the software images with the instanced path without anti-aliasing at a few points of
+    // the camera path. Pixels on shared edges may go to a different triangle, and stripe borders
+    // may round differently, so a few differing pixels are expected.
+    const int diffFrames = 4;
+    std::vector<unsigned int> glPixels(windowWidth * windowHeight);
+    long long differing = 0;
+    int maxDifference = 0;
+    for (int k = 0; k < diffFrames; k++) {
+        int f = k * options.frames / diffFrames;
+        benchmarkCamera(f, options.frames, extent);
+        gScene->UpdateTransforms();
+        frameUniforms.Update(f / 60.0f);
+        target.Bind();
+        glClearColor(0, 0, 0, 0);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        drawSceneInstanced();
+        glReadPixels(0, 0, windowWidth, windowHeight, GL_RGBA, GL_UNSIGNED_BYTE, &glPixels[0]);
+        target.Unbind();
+        gScene->DrawSoftware(renderer, f / 60.0f);
+        
+        std::vector<unsigned int>& pixels = renderer.GetPixels();
+        for (int y = 0; y < windowHeight; y++) {
+            for (int x = 0; x < windowWidth; x++) {
+                unsigned int a = glPixels[(windowHeight - 1 - y) * windowWidth + x], b = pixels[y * windowWidth + x];
+                int difference = 0;
+                for (int i = 0; i < 32; i += 8) difference = (int)fmax(difference, abs((int)(a >> i & 255) - (int)(b >> i & 255)));
+                if (difference > 1) differing++;
+                maxDifference = (int)fmax(maxDifference, difference);
+            }
+        }
+    }
+    long long comparedPixels = (long long)diffFrames * windowWidth * windowHeight;
+    fprintf(file, "\n],\"software_diff\":{\"frames\":%d,\"pixels\":%lld,\"differing_pixels\":%lld,"
+            "\"differing_ratio\":%.6f,\"max_channel_difference\":%d},", diffFrames, comparedPixels, differing,
+            (double)differing / comparedPixels, maxDifference);
+    printf("Software rasterizer differs from GL in %.3f%% of the pixels\n", 100.0 * differing / comparedPixels);
+    
+    // vector export of the whole venue on all threads
+    jobs.Start(0);
+    double exportStart = profiler.Now();
+    long long exportSize = gScene->ExportSvg("benchmark_export.svg", 0);
+    double exportTime = profiler.Now() - exportStart;
+    remove("benchmark_export.svg");
+    fprintf(file, "\"svg_export_ms\":%.3f,\"svg_export_kb\":%lld,", exportTime * 1000, exportSize / 1024);
+    jobs.Stop();
+    
+    double teardownStart = profiler.Now();
+    delete gScene;
+    fprintf(file, "\"teardown_ms\":%.3f}\n", (profiler.Now() - teardownStart) * 1000);
+    fclose(file);
+    printf("Wrote %s\n", options.output);
+    return 0;
+}
+
+struct ThumbnailOptions
+{
+    const char* output;     // 0 runs the interactive application
+    int size;
+};
+
+// Renders the default plan, framed as a whole, with the software rasterizer into a PPM image. No
+// window or OpenGL context is created, so this also works without a display or GPU driver. The
+// executable is still linked against OpenGL, GLEW and GLUT, so their libraries must be installed.
+int renderThumbnail(ThumbnailOptions options, int threads) {
+    if (options.size < 1) options.size = 1;
+    softwareOnly = true;
+    jobs.Start(threads);
+    double start = profiler.Now();
+    gScene = new Scene();
+    gScene->Initialize();
+    
+    vec2 min, max;
+    if (gScene->GetBounds(min, max)) {
+        float size = fmax(fmax(max.x - min.x, max.y - min.y) * 0.5f * 1.05f, 0.1f);
+        camera.Set(vec2((min.x + max.x) * 0.5f / size, (min.y + max.y) * 0.5f / size), size);
+    }
+    SoftwareRenderer renderer(options.size, options.size);
+    gScene->DrawSoftware(renderer, 0);
+    bool saved = renderer.Save(options.output);
+    if (saved) printf("Wrote %s in %.1f ms\n", options.output, (profiler.Now() - start) * 1000);
+    
+    delete gScene;
+    jobs.Stop();
+    return saved ? 0 : 1;
+}
+
+// writes the default plan as SVG without a display, like the thumbnail
+int exportPlan(const char* filename, int threads) {
+    softwareOnly = true;
+    jobs.Start(threads);
+    double start = profiler.Now();
+    gScene = new Scene();
+    gScene->Initialize();
+    long long size = gScene->ExportSvg(filename, 0);
+    if (size >= 0) printf("Wrote %s (%lld kB) in %.1f ms\n", filename, size / 1024, (profiler.Now() - start) * 1000);
+    
+    delete gScene;
+    jobs.Stop();
+    return size >= 0 ? 0 : 1;
+}
+
+struct InputEvent
+{
+    double time;
+    int type;               // 0 mouse, 1 motion, 2 key down, 3 key up
+    int button, state;      // mouse: button and state, keys: the key code
+    int x, y;
+    int modifiers;
+};
+
+// reads a recording of --record, returns false if the file cannot be used
+bool LoadInput(const char* filename, std::vector<InputEvent>& events) {
+    FILE* file = fopen(filename, "r");
+    if (!file) { printf("Cannot read %s\n", filename); return false; }
+    int width = 0, height = 0;
+    if (fscanf(file, "# eventplanner input v1 %d %d", &width, &height) != 2) {
+        printf("%s is not an input recording\n", filename);
+        fclose(file);
+        return false;
+    }
+    if (width != windowWidth || height != windowHeight) {
+        printf("%s was recorded in a %dx%d window, replaying it at %dx%d\n", filename, width, height, windowWidth, windowHeight);
+    }
+    
+    char line[256], type[16];
+    int number = 0;         // the first fgets reads the end of the header line
+    while (fgets(line, sizeof(line), file)) {
+        number++;
+        InputEvent event = {};
+        if (sscanf(line, "%lf %15s", &event.time, type) != 2) continue;     // rest of the header, empty lines
+        bool valid = false;
+        if (!strcmp(type, "mouse")) {
+            event.type = 0;
+            valid = sscanf(line, "%*f %*s %d %d %d %d %d", &event.button, &event.state, &event.x, &event.y, &event.modifiers) == 5;
+        }
+        else if (!strcmp(type, "motion")) {
+            event.type = 1;
+            valid = sscanf(line, "%*f %*s %d %d", &event.x, &event.y) == 2;
+        }
+        else if (!strcmp(type, "key") || !strcmp(type, "keyup")) {
+            event.type = type[3] ? 3 : 2;
+            valid = sscanf(line, "%*f %*s %d %d %d", &event.button, &event.x, &event.y) == 3 && event.button >= 0 && event.button < 256;
+        }
+        if (!valid) {
+            printf("%s:%d: cannot parse %s", filename, number, line);
+            fclose(file);
+            return false;
+        }
+        events.push_back(event);
+    }
+    fclose(file);
+    // the handlers are called in the order of the file, out of order times are clamped
+    for (int i = 1; i < events.size(); i++) events[i].time = fmax(events[i].time, events[i - 1].time);
+    return true;
+}
+
+void DispatchInput(InputEvent& event) {
+    switch (event.type) {
+        case 0:
+            replayModifiers = event.modifiers;
+            onMouse(event.button, event.state, event.x, event.y);
+            break;
+        case 1: onMouseDrag(event.x, event.y); break;
+        case 2: onKeyboard((unsigned char)event.button, event.x, event.y); break;
+        case 3: onKeyboardUp((unsigned char)event.button, event.x, event.y); break;
+    }
+}
+
+struct ReplayOptions
+{
+    const char* input;      // 0 runs the interactive application
+    const char* output;
+};
+
+// Plays a recording back without a window: the events are handed to the GLUT handlers at their
+// recorded times on a virtual clock that advances 1/60 s per iteration, the scheduler runs as in
+// the application and every frame it asks for is drawn with the software rasterizer. The clock
+// never looks at the wall, so the same recording always produces the same frames and the same
+// plan, and the measured frame times can be compared between builds.
+int replayInput(ReplayOptions options, int threads) {
+    std::vector<InputEvent> events;
+    if (!LoadInput(options.input, events)) return 1;
+    
+    softwareOnly = true;
+    jobs.Start(threads);
+    gScene = new Scene();
+    gScene->Initialize();
+    SoftwareRenderer renderer(windowWidth, windowHeight);
+    
+    const double clockStep = 1.0 / 60.0;
+    const double settleTime = 1.0;      // keep running after the last event until animations ended
+    double endTime = (events.empty() ? 0 : events.back().time) + settleTime;
+    virtualClock = 0;
+    scheduler.SetHeadless(true);
+    scheduler.Wake();
+    
+    std::vector<double> frameTimes, frameClocks;
+    double start = profiler.Now();
+    int next = 0;
+    for (long long tick = 0; tick * clockStep <= endTime; tick++) {
+        virtualClock = tick * clockStep;
+        while (next < events.size() && events[next].time <= virtualClock) DispatchInput(events[next++]);
+        if (!scheduler.IsRunning()) continue;      // asleep until the next event, as without replay
+        scheduler.Tick(onUpdate, isSimulating);
+        if (!scheduler.TakeRedisplay()) continue;
+        
+        double frameStart = profiler.Now();
+        profiler.Begin(SectionFrame);
+        UpdateFrame();
+        gScene->DrawSoftware(renderer, (float)virtualClock);
+        profiler.End(SectionFrame);
+        profiler.EndFrame();
+        frameTimes.push_back(profiler.Now() - frameStart);
+        frameClocks.push_back(virtualClock);
+    }
+    double total = profiler.Now() - start;
+    unsigned long long hash = gScene->Hash();
+    
+    printf("Replayed %d events in %d frames, %.1f ms, scene hash %016llx\n", (int)events.size(), (int)frameTimes.size(),
+           total * 1000, hash);
+    FILE* file = fopen(options.output, "w");
+    if (!file) printf("Cannot write %s\n", options.output);
+    else {
+        fprintf(file, "{\"recording\":%s,\"events\":%d,\"frames\":%d,\"virtual_s\":%.3f,\"total_ms\":%.3f,",
+                JsonString(options.input).c_str(), (int)events.size(), (int)frameTimes.size(), virtualClock, total * 1000);
+        writeBenchmarkStats(file, "frame_ms", frameTimes, 1000);
+        fprintf(file, ",\"scene_hash\":\"%016llx\",\"frame_times\":[", hash);
+        for (int i = 0; i < frameTimes.size(); i++) {
+            fprintf(file, "%s\n{\"t\":%.4f,\"ms\":%.3f}", i ? "," : "", frameClocks[i], frameTimes[i] * 1000);
+        }
+        fprintf(file, "\n]}\n");
+        fclose(file);
+        printf("Wrote %s\n", options.output);
+    }
+    
+    delete gScene;
+    jobs.Stop();
+    return file ? 0 : 1;
+}
+
+int main(int argc, char * argv[])
+{
+    int swapInterval = 1;
+    double frameCap = 0;
+    int threads = 0;
+    bool benchmark = false;
+    BenchmarkOptions benchmarkOptions = { 10000, 300, 1, "benchmark.json" };
+    ThumbnailOptions thumbnailOptions = { 0, 256 };
+    const char* svgFile = 0;
+    const char* recordFile = 0;
+    ReplayOptions replayOptions = { 0, "replay.json" };
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--no-vsync")) swapInterval = 0;
+        else if (!strcmp(argv[i], "--fps") && i + 1 < argc) frameCap = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--threads") && i + 1 < argc) threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--no-persistent-buffers")) persistentBuffers = false;
+        else if (!strcmp(argv[i], "--shader-dir") && i + 1 < argc) shaderDirectory = argv[++i];
+        else if (!strcmp(argv[i], "--msaa") && i + 1 < argc) msaaSamples = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--analytic-aa")) analyticCoverage = true;
+        else if (!strcmp(argv[i], "--scroll-stripes")) scrollStripes = true;
+        else if (!strcmp(argv[i], "--grid") && i + 1 < argc) {
+            snapGridSize = atof(argv[++i]);
+            snapToGrid = snapGridSize > 0;
+        }
+        else if (!strcmp(argv[i], "--benchmark") && i + 1 < argc) {
+            benchmark = true;
+            benchmarkOptions.objects = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--frames") && i + 1 < argc) benchmarkOptions.frames = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--seed") && i + 1 < argc) benchmarkOptions.seed = (unsigned int)atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--benchmark-out") && i + 1 < argc) benchmarkOptions.output = argv[++i];
+        else if (!strcmp(argv[i], "--thumbnail") && i + 1 < argc) thumbnailOptions.output = argv[++i];
+        else if (!strcmp(argv[i], "--thumbnail-size") && i + 1 < argc) thumbnailOptions.size = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--svg") && i + 1 < argc) svgFile = argv[++i];
+        else if (!strcmp(argv[i], "--egress-cells") && i + 1 < argc) egressField.SetCells(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "--exit") && i + 1 < argc) {
+            vec2 exit;
+            if (sscanf(argv[++i], "%f,%f", &exit.x, &exit.y) == 2) egressField.AddExit(exit);
+        }
+        else if (!strcmp(argv[i], "--cells") && i + 1 < argc) cellFile = argv[++i];
+        else if (!strcmp(argv[i], "--expo") && i + 1 < argc) expoItems = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--page-budget") && i + 1 < argc) pageBudget = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--record") && i + 1 < argc) recordFile = argv[++i];
+        else if (!strcmp(argv[i], "--replay") && i + 1 < argc) replayOptions.input = argv[++i];
+        else if (!strcmp(argv[i], "--replay-out") && i + 1 < argc) replayOptions.output = argv[++i];
+    }
+    
+    if (expoItems > 0 && !cellFile) cellFile = "expo.cells";
+    
+    // before glutInit, which needs a display
+    if (thumbnailOptions.output) return renderThumbnail(thumbnailOptions, threads);
+    if (svgFile) return exportPlan(svgFile, threads);
+    if (replayOptions.input) return replayInput(replayOptions, threads);
+    
+    glutInit(&argc, argv);
+
+#if !defined(__APPLE__)
+    glutInitContextVersion(majorVersion, minorVersion);
+#endif
+    glutInitWindowSize(windowWidth, windowHeight);     // application window is initially of resolution 512x512
+    glutInitWindowPosition(50, 50);            // relative location of the application window
+#if defined(__APPLE__)
+    glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH | GLUT_3_2_CORE_PROFILE);  // 8 bit R,G,B,A + double buffer + depth buffer
+#else
+    glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH);
+#endif
+    glutCreateWindow("Triangle Rendering");
+    
+#if !defined(__APPLE__)
+    glewExperimental = true;
+    glewInit();
+#endif
+    printf("GL Vendor    : %s\n", glGetString(GL_VENDOR));
     printf("GL Renderer  : %s\n", glGetString(GL_RENDERER));
     printf("GL Version (string)  : %s\n", glGetString(GL_VERSION));
     glGetIntegerv(GL_MAJOR_VERSION, &majorVersion);
@@ -1174,14 +7275,31 @@ int main(int argc, char * argv[])
     printf("GL Version (integer) : %d.%d\n", majorVersion, minorVersion);
     printf("GLSL Version : %s\n", glGetString(GL_SHADING_LANGUAGE_VERSION));
     
+    if (benchmark) {
+        // The hidden window only provides the context and everything is rendered offscreen, but
+        // GLUT still needs a display to create it: run under Xvfb or similar on machines without one.
+        glutHideWindow();
+        return runBenchmark(benchmarkOptions);
+    }
+    
     onInitialization();
+    if (recordFile && inputRecorder.Open(recordFile)) printf("Recording input to %s\n", recordFile);
     
     glutDisplayFunc(onDisplay); // register event handlers
     glutMouseFunc(onMouse);
     glutMotionFunc(onMouseDrag);
     glutKeyboardFunc(onKeyboard);
     glutKeyboardUpFunc(onKeyboardUp);
-    glutIdleFunc(onIdle);
+    
+    if (!shaderDirectory.empty()) {
+        shaderWatcher.Start();
+        glutTimerFunc(100, onShaderTimer, 0);
+    }
+    
+    jobs.Start(threads);
+    SetSwapInterval(swapInterval);
+    scheduler.SetFrameCap(frameCap);
+    scheduler.Wake();
     
     glutMainLoop();
     onExit();